@@ -5,39 +5,892 @@
  * Week 4 - Day 1: Programming project #2: Acronym Lookup Program
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
 
 /**
- * Class implementing Acronym with description and methods to match
+ * Class implementing a read-only view of characters owned by a StringArena or
+ * a MappedFile
+ */
+class StringRef {
+private:
+    const char *_data;
+    size_t _size;
+
+public:
+    StringRef(const char *data, size_t size) : _data(data), _size(size) {}
+
+    const char *data() const { return _data; }
+
+    size_t size() const { return _size; }
+
+    // Same as string::find(str) != string::npos
+    bool contains(const string &str) const {
+        if (str.empty()) {
+            return true;
+        }
+
+        const char *end = _data + _size;
+        for (const char *p = _data; (size_t)(end - p) >= str.size(); ++p) {
+            p = (const char *)memchr(p, str[0], end - p - str.size() + 1);
+            if (!p) {
+                return false;
+            }
+            if (!memcmp(p + 1, str.data() + 1, str.size() - 1)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool operator==(const string &str) const {
+        return _size == str.size() && !memcmp(_data, str.data(), _size);
+    }
+
+    bool operator==(const StringRef &other) const {
+        return _size == other._size && !memcmp(_data, other._data, _size);
+    }
+
+    // Byte order, a prefix first
+    bool operator<(const StringRef &other) const {
+        const int order = memcmp(_data, other._data, min(_size, other._size));
+        return order < 0 || (!order && _size < other._size);
+    }
+
+    friend ostream &operator<<(ostream &os, const StringRef &ref) {
+        return os.write(ref._data, (streamsize)ref._size);
+    }
+};
+
+/**
+ * Class implementing an append-only store shared by many strings. Strings
+ * are carved out of large blocks and never move, so views of them stay valid.
+ * Strings that are no longer used are only counted, their bytes are
+ * reclaimed by copying the others to a new arena.
+ */
+class StringArena {
+private:
+    static const size_t BLOCK = 64 << 10;
+
+    vector<unique_ptr<char[]>> _blocks;
+
+    // Free part of the last block
+    char *_next = nullptr;
+    size_t _free = 0;
+
+    size_t _size = 0;
+    size_t _released = 0;
+
+public:
+    /**
+     * Copy a string into the arena
+     *
+     * @return View of the copy
+     */
+    StringRef append(const StringRef &str) {
+        if (str.size() > _free) {
+            _free = str.size() > BLOCK ? str.size() : BLOCK;
+            _blocks.emplace_back(new char[_free]);
+            _next = _blocks.back().get();
+        }
+
+        char *copy = _next;
+        memcpy(copy, str.data(), str.size());
+        _next += str.size();
+        _free -= str.size();
+        _size += str.size();
+        return StringRef(copy, str.size());
+    }
+
+    // Count the bytes of a string that is no longer used
+    void release(size_t size) { _released += size; }
+
+    size_t size() const { return _size; }
+
+    size_t released() const { return _released; }
+
+    void swap(StringArena &other) {
+        _blocks.swap(other._blocks);
+        std::swap(_next, other._next);
+        std::swap(_free, other._free);
+        std::swap(_size, other._size);
+        std::swap(_released, other._released);
+    }
+};
+
+/**
+ * Class implementing a read-only memory mapping of a whole file
+ */
+class MappedFile {
+private:
+    const char *_data = nullptr;
+    size_t _size = 0;
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() { close(); }
+
+    /**
+     * Map the given file into memory. Empty files map successfully with a
+     * null data pointer and zero size.
+     *
+     * @param fileName Path of the file to map
+     * @return true on success, false if the file could not be opened or mapped
+     */
+    bool open(const string &fileName) {
+        close();
+
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        bool status = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (status && st.st_size > 0) {
+            void *addr = mmap(nullptr, (size_t)st.st_size, PROT_READ,
+                              MAP_PRIVATE, fd, 0);
+            if (MAP_FAILED == addr) {
+                status = false;
+            } else {
+                _data = static_cast<const char *>(addr);
+                _size = (size_t)st.st_size;
+            }
+        }
+
+        ::close(fd);
+        return status;
+    }
+
+    void close() {
+        if (_data) {
+            munmap(const_cast<char *>(_data), _size);
+        }
+        _data = nullptr;
+        _size = 0;
+    }
+
+    const char *data() const { return _data; }
+
+    size_t size() const { return _size; }
+
+    bool contains(const char *p) const {
+        return p >= _data && p < _data + _size;
+    }
+};
+
+/**
+ * Class implementing Acronym with description and methods to match. Records
+ * are small and stored by value, viewing strings that live in the mapped data
+ * file, or in a StringArena for acronyms added during the session.
  */
 class Acronym {
 private:
-    const string _acronym;
-    const string _desc;
+    // Null once removed
+    const char *_acronym;
+    const char *_desc;
+    uint32_t _acronymLength;
+    uint32_t _descLength;
+
+    // Parts of the text, the description followed by the acronym in
+    // parentheses
+    array<StringRef, 4> parts() const {
+        return {{getDesc(), StringRef(" (", 2), getAcronym(),
+                 StringRef(")", 1)}};
+    }
 
 public:
-    Acronym(const string &acronym, const string &desc)
-        : _acronym(acronym), _desc(desc) {}
+    Acronym(const StringRef &acronym, const StringRef &desc)
+        : _acronym(acronym.data()), _desc(desc.data()),
+          _acronymLength((uint32_t)acronym.size()),
+          _descLength((uint32_t)desc.size()) {}
 
-    // npos returned when entry is not found
+    // Same as toString().find(str) != string::npos, without building the text
     bool match(const string &str) const {
-        return toString().find(str) != string::npos;
+        const array<StringRef, 4> text = parts();
+        size_t end = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i].contains(str)) {
+                return true;
+            }
+            end += text[i].size();
+
+            // Occurrences running past the end of a part start within
+            // str.size() - 1 bytes of it
+            if (i + 1 < text.size() && str.size() > 1) {
+                const size_t from = end - min(end, str.size() - 1);
+                if (slice(from, end + str.size() - 1).find(str) !=
+                    string::npos) {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Bytes of the text from begin up to end, or up to the end of the text
+     */
+    string slice(size_t begin, size_t end) const {
+        string bytes;
+        size_t offset = 0;
+        for (const StringRef &part : parts()) {
+            const size_t from = max(begin, offset);
+            const size_t to = min(end, offset + part.size());
+            if (from < to) {
+                bytes.append(part.data() + from - offset, to - from);
+            }
+            offset += part.size();
+        }
+        return bytes;
+    }
+
+    string toString() const { return slice(0, SIZE_MAX); }
+
+    StringRef getAcronym() const { return StringRef(_acronym, _acronymLength); }
+
+    StringRef getDesc() const { return StringRef(_desc, _descLength); }
+
+    bool isRemoved() const { return !_acronym; }
+
+    void remove() { _acronym = nullptr; }
+};
+
+/**
+ * Class implementing an inverted index from the trigrams (3-byte substrings)
+ * of texts to the ids of the texts containing them. Any text containing a
+ * string contains all trigrams of the string, so the texts containing all of
+ * them are the candidates of a substring search.
+ */
+class TrigramIndex {
+private:
+    // Ids of the texts containing each trigram, in increasing order
+    unordered_map<uint32_t, vector<uint32_t>> _postings;
+
+    static vector<uint32_t> trigrams(const char *text, size_t size) {
+        vector<uint32_t> grams;
+        for (size_t i = 0; i + MIN_LENGTH <= size; ++i) {
+            grams.push_back((uint32_t)(unsigned char)text[i] << 16 |
+                            (uint32_t)(unsigned char)text[i + 1] << 8 |
+                            (uint32_t)(unsigned char)text[i + 2]);
+        }
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+
+public:
+    // Shortest string the index can search
+    static const size_t MIN_LENGTH = 3;
+
+    /**
+     * Index a text. Ids must be added in increasing order.
+     */
+    void add(uint32_t id, const StringRef &text) {
+        for (uint32_t gram : trigrams(text.data(), text.size())) {
+            _postings[gram].push_back(id);
+        }
+    }
+
+    void clear() { _postings.clear(); }
+
+    void shrinkToFit() {
+        for (auto &posting : _postings) {
+            posting.second.shrink_to_fit();
+        }
+    }
+
+    /**
+     * Find the texts containing all trigrams of a string of at least
+     * MIN_LENGTH characters, by intersecting their postings from the shortest
+     *
+     * @return Candidate ids in increasing order
+     */
+    vector<uint32_t> candidates(const string &str) const {
+        vector<const vector<uint32_t> *> lists;
+        for (uint32_t gram : trigrams(str.data(), str.size())) {
+            const auto it = _postings.find(gram);
+            if (it == _postings.end()) {
+                return {};
+            }
+            lists.push_back(&it->second);
+        }
+        sort(lists.begin(), lists.end(),
+             [](const vector<uint32_t> *a, const vector<uint32_t> *b) {
+                 return a->size() < b->size();
+             });
+
+        vector<uint32_t> ids(*lists[0]);
+        for (size_t i = 1; i < lists.size() && !ids.empty(); ++i) {
+            auto from = lists[i]->begin();
+            size_t kept = 0;
+            for (uint32_t id : ids) {
+                from = lower_bound(from, lists[i]->end(), id);
+                if (from == lists[i]->end()) {
+                    break;
+                }
+                if (*from == id) {
+                    ids[kept++] = id;
+                }
+            }
+            ids.resize(kept);
+        }
+
+        return ids;
+    }
+};
+
+/**
+ * Class implementing a radix trie of terms and their frequencies, giving the
+ * most frequent terms starting with a prefix. Edge labels are views into a
+ * shared buffer and children are kept in byte order, so a depth-first walk
+ * visits terms in byte order.
+ *
+ * Each node with more than TOP terms below it stores the TOP most frequent
+ * ones, merged from the lists of its children. Any other node has fewer than
+ * 2 * TOP nodes below it, since nodes without a term have two children or
+ * more, and its terms are ranked by walking them. The lists are built for the
+ * whole trie in a single bottom-up pass by rank(), and kept up to date along
+ * the path of each term changed afterwards.
+ */
+class PrefixTrie {
+public:
+    // Completions returned for a prefix
+    static const size_t TOP = 10;
+
+private:
+    static const uint32_t NONE = UINT32_MAX;
+    static const uint32_t ROOT = 0;
+    static const size_t MIN_CHILDREN = 16;
+
+    struct Node {
+        // Edge label from the parent in _labels
+        uint32_t label;
+        uint32_t labelLength;
+
+        uint32_t parent;
+        uint32_t firstChild;
+        uint32_t nextSibling;
+
+        // Frequency of the term ending here, 0 if none does
+        uint32_t count;
+
+        // Terms ending here or below
+        uint32_t terms;
+
+        // Index of the most frequent terms in _tops, NONE until the node has
+        // more than TOP terms
+        uint32_t top;
+
+        // First byte of the label, compared without reading _labels
+        unsigned char first;
+    };
+
+    // Entry of the children table, empty when child is NONE
+    struct ChildSlot {
+        uint32_t parent;
+        uint32_t child;
+    };
+
+    vector<Node> _nodes;
+    vector<char> _labels;
+    vector<vector<uint32_t>> _tops;
+
+    // Children by parent and first byte, so that finding a child does not
+    // walk its siblings. Open addressing with linear probing, the capacity is
+    // a power of two.
+    vector<ChildSlot> _children;
+    size_t _childCount = 0;
+
+    // Set once the lists of the most frequent terms are built. Children are
+    // only kept in byte order from then on.
+    bool _ranked = false;
+
+    uint32_t newNode(uint32_t parent, uint32_t label, uint32_t labelLength) {
+        const unsigned char first = labelLength ? _labels[label] : 0;
+        _nodes.push_back(
+            {label, labelLength, parent, NONE, NONE, 0, 0, NONE, first});
+        return (uint32_t)(_nodes.size() - 1);
+    }
+
+    // Slot of the child of a node starting with a byte, or the empty slot
+    // where it would go
+    size_t childSlot(uint32_t parent, unsigned char first) const {
+        const uint64_t key =
+            ((uint64_t)parent << 8 | first) * 0x9e3779b97f4a7c15ull;
+        const size_t mask = _children.size() - 1;
+        size_t i = (size_t)(key >> 32) & mask;
+        while (NONE != _children[i].child &&
+               (parent != _children[i].parent ||
+                first != _nodes[_children[i].child].first)) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    // Child of a node whose label starts with a byte, or NONE
+    uint32_t child(uint32_t id, char first) const {
+        return _children[childSlot(id, (unsigned char)first)].child;
+    }
+
+    /**
+     * Map a node from its parent and first byte, in place of any node mapped
+     * there before
+     */
+    void setChild(uint32_t id) {
+        ChildSlot &slot = _children[childSlot(_nodes[id].parent,
+                                              _nodes[id].first)];
+        _childCount += NONE == slot.child;
+        slot = {_nodes[id].parent, id};
+
+        if (_childCount * 2 > _children.size()) {
+            _children.assign(_children.size() * 2, {NONE, NONE});
+            _childCount = 0;
+            for (uint32_t c = ROOT + 1; c < _nodes.size(); ++c) {
+                ChildSlot &moved =
+                    _children[childSlot(_nodes[c].parent, _nodes[c].first)];
+                _childCount += NONE == moved.child;
+                moved = {_nodes[c].parent, c};
+            }
+        }
+    }
+
+    // Link a node among the children of its parent, in byte order once
+    // ranked
+    void link(uint32_t id) {
+        const unsigned char first = _nodes[id].first;
+        uint32_t *next = &_nodes[_nodes[id].parent].firstChild;
+        while (_ranked && NONE != *next && _nodes[*next].first < first) {
+            next = &_nodes[*next].nextSibling;
+        }
+        _nodes[id].nextSibling = *next;
+        *next = id;
+        setChild(id);
+    }
+
+    // Put the children of every node in byte order
+    void sortChildren() {
+        vector<uint32_t> children;
+        for (Node &node : _nodes) {
+            children.clear();
+            for (uint32_t c = node.firstChild; NONE != c;
+                 c = _nodes[c].nextSibling) {
+                children.push_back(c);
+            }
+            sort(children.begin(), children.end(), [&](uint32_t a, uint32_t b) {
+                return _nodes[a].first < _nodes[b].first;
+            });
+
+            uint32_t *next = &node.firstChild;
+            for (uint32_t c : children) {
+                *next = c;
+                next = &_nodes[c].nextSibling;
+            }
+            *next = NONE;
+        }
+    }
+
+    // Length of the common prefix of a node label and a string starting with
+    // the first byte of the label
+    size_t common(uint32_t id, const char *str, size_t size) const {
+        const char *label = _labels.data() + _nodes[id].label;
+        const size_t length = min((size_t)_nodes[id].labelLength, size);
+        size_t i = 1;
+        while (i < length && label[i] == str[i]) {
+            ++i;
+        }
+        return i;
+    }
+
+    /**
+     * Find the node of a term, adding the nodes it needs
+     */
+    uint32_t insert(const char *term, size_t size) {
+        uint32_t id = ROOT;
+        size_t i = 0;
+        while (i < size) {
+            const uint32_t c = child(id, term[i]);
+            if (NONE == c) {
+                const uint32_t label = (uint32_t)_labels.size();
+                _labels.insert(_labels.end(), term + i, term + size);
+                const uint32_t leaf =
+                    newNode(id, label, (uint32_t)(size - i));
+                link(leaf);
+                return leaf;
+            }
+
+            const size_t matched = common(c, term + i, size - i);
+            if (matched < _nodes[c].labelLength) {
+                // Split the label, the upper part takes the place of c
+                const uint32_t upper =
+                    newNode(id, _nodes[c].label, (uint32_t)matched);
+                Node &lower = _nodes[c];
+                _nodes[upper].terms = lower.terms;
+                _nodes[upper].nextSibling = lower.nextSibling;
+                _nodes[upper].firstChild = c;
+                if (NONE != lower.top) {
+                    _nodes[upper].top = (uint32_t)_tops.size();
+                    _tops.push_back(_tops[lower.top]);
+                }
+
+                uint32_t *next = &_nodes[id].firstChild;
+                while (*next != c) {
+                    next = &_nodes[*next].nextSibling;
+                }
+                *next = upper;
+                setChild(upper);
+
+                lower.label += (uint32_t)matched;
+                lower.labelLength -= (uint32_t)matched;
+                lower.first = _labels[lower.label];
+                lower.parent = upper;
+                lower.nextSibling = NONE;
+                setChild(c);
+                id = upper;
+            } else {
+                id = c;
+            }
+            i += matched;
+        }
+
+        return id;
+    }
+
+    // Add the terms ending at or below a node, in byte order
+    void collect(uint32_t id, vector<uint32_t> &terms) const {
+        if (_nodes[id].count) {
+            terms.push_back(id);
+        }
+        for (uint32_t c = _nodes[id].firstChild; NONE != c;
+             c = _nodes[c].nextSibling) {
+            collect(c, terms);
+        }
+    }
+
+    // Sort terms in byte order by decreasing frequency, keeping the TOP first
+    void keepTop(vector<uint32_t> &terms) const {
+        stable_sort(terms.begin(), terms.end(), [&](uint32_t a, uint32_t b) {
+            return _nodes[a].count > _nodes[b].count;
+        });
+        if (terms.size() > TOP) {
+            terms.resize(TOP);
+        }
+    }
+
+    /**
+     * Rebuild the list of the most frequent terms of a node from its
+     * children, whose lists must be up to date
+     */
+    void rank(uint32_t id, vector<uint32_t> &terms) {
+        if (_nodes[id].terms <= TOP) {
+            if (NONE != _nodes[id].top) {
+                _tops[_nodes[id].top].clear();
+            }
+            return;
+        }
+
+        terms.clear();
+        if (_nodes[id].count) {
+            terms.push_back(id);
+        }
+        for (uint32_t c = _nodes[id].firstChild; NONE != c;
+             c = _nodes[c].nextSibling) {
+            if (_nodes[c].terms > TOP) {
+                const vector<uint32_t> &top = _tops[_nodes[c].top];
+                terms.insert(terms.end(), top.begin(), top.end());
+            } else {
+                collect(c, terms);
+            }
+        }
+        keepTop(terms);
+
+        if (NONE == _nodes[id].top) {
+            _nodes[id].top = (uint32_t)_tops.size();
+            _tops.emplace_back();
+        }
+        _tops[_nodes[id].top] = terms;
+    }
+
+    /**
+     * Change the frequency of a term, ranking its ancestors again if the
+     * lists are built
+     */
+    void update(const char *term, size_t size, int delta) {
+        const uint32_t id = insert(term, size);
+        const uint32_t count = _nodes[id].count;
+        if (delta < 0 && !count) {
+            return;
+        }
+
+        // Terms appearing or disappearing change the counts of the path
+        if (!count || (delta < 0 && 1 == count)) {
+            for (uint32_t a = id; NONE != a; a = _nodes[a].parent) {
+                _nodes[a].terms += delta;
+            }
+        }
+        _nodes[id].count += delta;
+
+        if (_ranked) {
+            vector<uint32_t> terms;
+            for (uint32_t a = id; NONE != a; a = _nodes[a].parent) {
+                rank(a, terms);
+            }
+        }
+    }
+
+public:
+    PrefixTrie() { clear(); }
+
+    /**
+     * Count one more occurrence of a term
+     */
+    void add(const StringRef &term) { update(term.data(), term.size(), 1); }
+
+    /**
+     * Count one occurrence less of a term
+     */
+    void remove(const StringRef &term) {
+        update(term.data(), term.size(), -1);
+    }
+
+    /**
+     * Build the lists of the most frequent terms of all nodes, children
+     * before their parents
+     */
+    void rank() {
+        if (!_ranked) {
+            sortChildren();
+        }
+
+        vector<uint32_t> order{ROOT};
+        for (size_t i = 0; i < order.size(); ++i) {
+            for (uint32_t c = _nodes[order[i]].firstChild; NONE != c;
+                 c = _nodes[c].nextSibling) {
+                order.push_back(c);
+            }
+        }
+
+        vector<uint32_t> terms;
+        for (size_t i = order.size(); i-- > 0;) {
+            rank(order[i], terms);
+        }
+        _ranked = true;
+    }
+
+    void clear() {
+        _nodes.clear();
+        _labels.clear();
+        _tops.clear();
+        _children.assign(MIN_CHILDREN, {NONE, NONE});
+        _childCount = 0;
+        _ranked = false;
+        newNode(NONE, 0, 0);
+    }
+
+    /**
+     * Find the most frequent terms starting with a prefix
+     *
+     * @return Up to TOP terms with their frequencies, by decreasing
+     *         frequency and then in byte order
+     */
+    vector<pair<string, uint32_t>> complete(const string &prefix) {
+        if (!_ranked) {
+            rank();
+        }
+
+        vector<pair<string, uint32_t>> completions;
+        uint32_t id = ROOT;
+        for (size_t i = 0; i < prefix.size();) {
+            id = child(id, prefix[i]);
+            if (NONE == id) {
+                return completions;
+            }
+
+            const size_t matched = common(id, &prefix[i], prefix.size() - i);
+            if (matched < min((size_t)_nodes[id].labelLength,
+                              prefix.size() - i)) {
+                return completions;
+            }
+            i += matched;
+        }
+
+        vector<uint32_t> terms;
+        if (_nodes[id].terms > TOP) {
+            terms = _tops[_nodes[id].top];
+        } else {
+            collect(id, terms);
+            keepTop(terms);
+        }
+
+        for (uint32_t term : terms) {
+            string text;
+            for (uint32_t a = term; ROOT != a; a = _nodes[a].parent) {
+                text.insert(0, _labels.data() + _nodes[a].label,
+                            _nodes[a].labelLength);
+            }
+            completions.emplace_back(text, _nodes[term].count);
+        }
+
+        return completions;
+    }
+};
+
+/**
+ * Class implementing an open-addressing hash table from acronym names to
+ * their slots in a vector of acronyms, with linear probing. Erased entries
+ * leave tombstones so that probe sequences stay intact, and are dropped when
+ * the table is rehashed.
+ */
+class AcronymTable {
+public:
+    // Slot returned for an acronym missing from the table
+    static const uint32_t NONE = UINT32_MAX;
+
+private:
+    static const uint32_t TOMBSTONE = UINT32_MAX - 1;
+    static const size_t MIN_CAPACITY = 16;
+
+    struct Bucket {
+        uint32_t slot = NONE;
+        uint32_t hash = 0;
+    };
+
+    const vector<Acronym> &_acronyms;
+
+    // Capacity is a power of two
+    vector<Bucket> _buckets;
+
+    // Live entries, and live entries plus tombstones
+    size_t _size = 0;
+    size_t _used = 0;
+
+    // 32-bit FNV-1a
+    static uint32_t hashOf(const char *data, size_t size) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    /**
+     * Find the bucket of an acronym, or the empty bucket ending its probe
+     * sequence
+     */
+    size_t probe(const StringRef &acronym) const {
+        const uint32_t hash = hashOf(acronym.data(), acronym.size());
+        const size_t mask = _buckets.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            const Bucket &bucket = _buckets[i];
+            if (NONE == bucket.slot ||
+                (TOMBSTONE != bucket.slot && hash == bucket.hash &&
+                 _acronyms[bucket.slot].getAcronym() == acronym)) {
+                return i;
+            }
+        }
+    }
+
+    /**
+     * Place an entry known to be missing in the first free bucket of its
+     * probe sequence
+     */
+    void place(uint32_t slot, uint32_t hash) {
+        const size_t mask = _buckets.size() - 1;
+        size_t i = hash & mask;
+        while (NONE != _buckets[i].slot && TOMBSTONE != _buckets[i].slot) {
+            i = (i + 1) & mask;
+        }
+
+        _used += NONE == _buckets[i].slot;
+        ++_size;
+        _buckets[i].slot = slot;
+        _buckets[i].hash = hash;
+    }
+
+    /**
+     * Move the live entries to a table sized for twice their number
+     */
+    void rehash() {
+        size_t capacity = MIN_CAPACITY;
+        while (capacity < (_size + 1) * 2) {
+            capacity *= 2;
+        }
+
+        vector<Bucket> buckets(capacity);
+        buckets.swap(_buckets);
+        _size = _used = 0;
+        for (const Bucket &bucket : buckets) {
+            if (bucket.slot < TOMBSTONE) {
+                place(bucket.slot, bucket.hash);
+            }
+        }
+    }
+
+public:
+    explicit AcronymTable(const vector<Acronym> &acronyms)
+        : _acronyms(acronyms), _buckets(MIN_CAPACITY) {}
+
+    /**
+     * Find the slot of an acronym, or NONE
+     */
+    uint32_t find(const StringRef &acronym) const {
+        return _buckets[probe(acronym)].slot;
     }
 
-    string toString() const {
-        ostringstream oss;
-        oss << getDesc() << " (" << getAcronym() << ")";
-        return oss.str();
+    /**
+     * Add the acronym stored in a slot, which must not be in the table yet
+     */
+    void insert(uint32_t slot) {
+        // Tombstones lengthen probe sequences as much as live entries
+        if ((_used + 1) * 4 > _buckets.size() * 3) {
+            rehash();
+        }
+        const StringRef acronym = _acronyms[slot].getAcronym();
+        place(slot, hashOf(acronym.data(), acronym.size()));
     }
 
-    const string &getAcronym() const { return _acronym; }
+    /**
+     * Remove an acronym, while its slot still holds it
+     *
+     * @return Slot of the acronym, or NONE if it is missing
+     */
+    uint32_t erase(const StringRef &acronym) {
+        Bucket &bucket = _buckets[probe(acronym)];
+        const uint32_t slot = bucket.slot;
+        if (NONE != slot) {
+            bucket.slot = TOMBSTONE;
+            --_size;
+        }
 
-    const string &getDesc() const { return _desc; }
+        return slot;
+    }
+
+    void clear() {
+        _buckets.assign(MIN_CAPACITY, Bucket());
+        _size = _used = 0;
+    }
 };
 
 /**
@@ -47,42 +900,224 @@ public:
 class AcronymList {
 private:
     const string _fileName;
-    vector<const Acronym *> _acronyms;
 
-public:
-    explicit AcronymList(const string &fileName) : _fileName(fileName) {}
+    // Data file, viewed by the acronyms loaded from it
+    MappedFile _file;
+
+    // Acronyms in insertion order, removed ones stay in place until compacted
+    vector<Acronym> _acronyms;
+    size_t _removed = 0;
+
+    // Strings of the acronyms added during the session, and their slots
+    StringArena _strings;
+    vector<uint32_t> _copied;
+
+    // Slot of each acronym name in _acronyms
+    AcronymTable _slots{_acronyms};
+
+    // Text of each acronym by its position in _acronyms
+    TrigramIndex _index;
+
+    // Acronym names and description words, by the number of acronyms with
+    // each
+    PrefixTrie _prefixes;
+
+    // Acronyms in _index and _prefixes, which are built on first use
+    size_t _indexed = 0;
+
+    /**
+     * Trim blanks the way the original string-based add did, including its
+     * use of the last non-blank position as a length
+     *
+     * @throws out_of_range if the string is blank
+     */
+    static StringRef trim(const StringRef &str) {
+        const char *begin = str.data();
+        const char *end = begin + str.size();
+        const char *first = begin;
+        while (first < end && (' ' == *first || '\t' == *first)) {
+            ++first;
+        }
+        if (first == end) {
+            throw out_of_range("blank acronym or description");
+        }
+
+        const char *last = end - 1;
+        while (' ' == *last || '\t' == *last) {
+            --last;
+        }
+        const size_t length = min((size_t)(last - begin) + 1,
+                                  (size_t)(end - first));
+        return StringRef(first, length);
+    }
+
+    /**
+     * Add an acronym unless its name is taken
+     *
+     * @param copy Copy the strings to _strings, otherwise they must outlive
+     *             the list
+     */
+    bool add(const StringRef &acro, const StringRef &desc, bool copy) {
+        const StringRef acronym = trim(acro);
+        const bool found = AcronymTable::NONE != _slots.find(acronym);
+
+        if (!found) {
+            const StringRef description = trim(desc);
+            _acronyms.emplace_back(copy ? _strings.append(acronym) : acronym,
+                                   copy ? _strings.append(description)
+                                        : description);
+            _slots.insert((uint32_t)(_acronyms.size() - 1));
+            if (copy) {
+                _copied.push_back((uint32_t)(_acronyms.size() - 1));
+            }
+        }
+
+        return !found;
+    }
+
+    /**
+     * Count or uncount the name and the distinct description words of an
+     * acronym in the prefix trie
+     */
+    void updatePrefixes(const Acronym &ac, bool add) {
+        vector<StringRef> terms{ac.getAcronym()};
+        const StringRef desc = ac.getDesc();
+        const char *end = desc.data() + desc.size();
+        for (const char *p = desc.data(); p < end;) {
+            while (p < end && (' ' == *p || '\t' == *p)) {
+                ++p;
+            }
+            const char *word = p;
+            while (p < end && ' ' != *p && '\t' != *p) {
+                ++p;
+            }
+            if (p > word) {
+                terms.emplace_back(word, p - word);
+            }
+        }
+        sort(terms.begin(), terms.end());
+        terms.erase(unique(terms.begin(), terms.end()), terms.end());
+
+        for (const StringRef &term : terms) {
+            if (add) {
+                _prefixes.add(term);
+            } else {
+                _prefixes.remove(term);
+            }
+        }
+    }
+
+    /**
+     * Index the acronyms added since the last update
+     */
+    void updateIndexes() {
+        const bool rebuild = !_indexed;
+        for (; _indexed < _acronyms.size(); ++_indexed) {
+            const Acronym &ac = _acronyms[_indexed];
+            if (!ac.isRemoved()) {
+                const string text = ac.toString();
+                _index.add((uint32_t)_indexed,
+                           StringRef(text.data(), text.size()));
+                updatePrefixes(ac, true);
+            }
+        }
+
+        // Release the spare capacity left by growing while indexing
+        if (rebuild) {
+            _index.shrinkToFit();
+        }
+    }
 
-    ~AcronymList() {
-        for (auto ac : _acronyms) {
-            delete ac;
+    /**
+     * Drop the strings of removed acronyms from _strings. Only the acronyms
+     * added during the session are visited and none of them moves, so the
+     * indexes stay valid.
+     */
+    void compactStrings() {
+        StringArena strings;
+        size_t kept = 0;
+        for (uint32_t slot : _copied) {
+            Acronym &ac = _acronyms[slot];
+            if (!ac.isRemoved()) {
+                ac = Acronym(strings.append(ac.getAcronym()),
+                             strings.append(ac.getDesc()));
+                _copied[kept++] = slot;
+            }
         }
+        _copied.erase(_copied.begin() + kept, _copied.end());
+        _strings.swap(strings);
     }
 
+    /**
+     * Drop removed acronyms and the strings only they used, index the others
+     * at their new positions on next use
+     */
+    void compact() {
+        StringArena strings;
+        size_t kept = 0;
+        _copied.clear();
+        for (const Acronym &ac : _acronyms) {
+            if (ac.isRemoved()) {
+                continue;
+            }
+            if (_file.contains(ac.getAcronym().data())) {
+                _acronyms[kept++] = ac;
+            } else {
+                _copied.push_back((uint32_t)kept);
+                _acronyms[kept++] = Acronym(strings.append(ac.getAcronym()),
+                                            strings.append(ac.getDesc()));
+            }
+        }
+        _acronyms.erase(_acronyms.begin() + kept, _acronyms.end());
+        _strings.swap(strings);
+        _removed = 0;
+
+        _slots.clear();
+        for (size_t i = 0; i < _acronyms.size(); ++i) {
+            _slots.insert((uint32_t)i);
+        }
+        _index.clear();
+        _prefixes.clear();
+        _indexed = 0;
+    }
+
+public:
+    explicit AcronymList(const string &fileName) : _fileName(fileName) {}
+
+    /**
+     * Load the acronyms of the data file, two lines each, up to an empty
+     * line or an acronym without a description. The file is mapped and the
+     * acronyms view its lines in place.
+     */
     int load() {
         int err = -1;
 
-        ifstream ifs(_fileName);
-        if (ifs.is_open()) {
-            while (ifs.good()) {
-                string acronym;
-                getline(ifs, acronym);
-                if (acronym.empty()) {
+        if (_file.open(_fileName)) {
+            const char *p = _file.data();
+            const char *end = p + _file.size();
+            while (p < end) {
+                const char *eol = (const char *)memchr(p, '\n', end - p);
+                if (!eol || eol == p) {
                     break;
                 }
+                const StringRef acronym(p, eol - p);
 
-                if (ifs.eof()) {
+                p = eol + 1;
+                eol = (const char *)memchr(p, '\n', end - p);
+                const StringRef desc(p, (eol ? eol : end) - p);
+                if (!desc.size()) {
                     break;
                 }
 
-                string desc;
-                getline(ifs, desc);
-                if (desc.empty()) {
+                add(acronym, desc, false);
+                if (!eol) {
                     break;
                 }
-
-                add(acronym, desc);
+                p = eol + 1;
             }
-            ifs.close();
+
+            // Release the spare capacity left by growing while loading
+            _acronyms.shrink_to_fit();
 
             err = 0;
         }
@@ -90,69 +1125,100 @@ public:
         return err;
     }
 
+    /**
+     * Write the acronyms to a temporary file that then replaces the data
+     * file, which the loaded acronyms still view
+     */
     int save() const {
         int err = -1;
-        ofstream ofs(_fileName);
+        const string tempName = _fileName + ".tmp";
+        ofstream ofs(tempName);
         if (ofs.is_open()) {
-            for (auto ac : _acronyms) {
-                ofs << ac->getAcronym() << endl << ac->getDesc() << endl;
+            for (const Acronym &ac : _acronyms) {
+                if (!ac.isRemoved()) {
+                    ofs << ac.getAcronym() << '\n' << ac.getDesc() << '\n';
+                }
             }
 
             ofs.close();
-            err = 0;
+            if (ofs && !rename(tempName.c_str(), _fileName.c_str())) {
+                err = 0;
+            } else {
+                ::remove(tempName.c_str());
+            }
         }
 
         return err;
     }
 
     void list() const {
-        for (auto ac : _acronyms) {
-            cout << ac->toString() << endl;
+        for (const Acronym &ac : _acronyms) {
+            if (!ac.isRemoved()) {
+                cout << ac.toString() << endl;
+            }
         }
     }
 
-    void search(const string &str) const {
-        for (auto ac : _acronyms) {
-            if (ac->match(str)) {
-                cout << ac->toString() << endl;
+    void search(const string &str) {
+        // Strings shorter than a trigram are matched against every acronym
+        if (str.size() < TrigramIndex::MIN_LENGTH) {
+            for (const Acronym &ac : _acronyms) {
+                if (!ac.isRemoved() && ac.match(str)) {
+                    cout << ac.toString() << endl;
+                }
             }
+            return;
         }
-    }
 
-    bool remove(const string &str) {
-        bool removed = false;
-        for (auto it = _acronyms.begin(); it != _acronyms.end();) {
-            if ((*it)->getAcronym() == str) {
-                it = _acronyms.erase(it);
-                removed = true;
-            } else {
-                ++it;
+        updateIndexes();
+        for (uint32_t id : _index.candidates(str)) {
+            const Acronym &ac = _acronyms[id];
+            if (!ac.isRemoved() && ac.match(str)) {
+                cout << ac.toString() << endl;
             }
         }
+    }
 
-        return removed;
+    void prefix(const string &str) {
+        updateIndexes();
+        for (const auto &completion : _prefixes.complete(str)) {
+            cout << completion.first << " [" << completion.second << "]"
+                 << endl;
+        }
     }
 
-    bool add(const string &acro, const string &desc) {
-        bool found = false;
-        const string acronym = acro.substr(acro.find_first_not_of(" \t"),
-                                           acro.find_last_not_of(" \t") + 1);
+    bool remove(const string &str) {
+        const uint32_t slot = _slots.erase(StringRef(str.data(), str.size()));
+        if (AcronymTable::NONE == slot) {
+            return false;
+        }
 
-        for (auto ac : _acronyms) {
-            if (ac->getAcronym() == acronym) {
-                found = true;
-                break;
-            }
+        Acronym &ac = _acronyms[slot];
+        if (slot < _indexed) {
+            updatePrefixes(ac, false);
+        }
+        if (!_file.contains(ac.getAcronym().data())) {
+            _strings.release(ac.getAcronym().size() + ac.getDesc().size());
         }
+        ac.remove();
+        ++_removed;
 
-        if (!found) {
-            const string description =
-                desc.substr(desc.find_first_not_of(" \t"),
-                            desc.find_last_not_of(" \t") + 1);
-            _acronyms.push_back(new Acronym(acronym, description));
+        // Slots, strings and postings of removed acronyms are reclaimed once
+        // they are the majority, so churn does not grow memory without bound.
+        // Strings alone are reclaimed without moving any acronym, which keeps
+        // the indexes.
+        if (_removed > _acronyms.size() / 2) {
+            compact();
+        } else if (_strings.released() > _strings.size() / 2) {
+            compactStrings();
         }
 
-        return !found;
+        return true;
+    }
+
+    bool add(const string &acro, const string &desc) {
+        return add(StringRef(acro.data(), acro.size()),
+                   StringRef(desc.data(), desc.size()), true);
     }
 };
 
@@ -169,6 +1235,8 @@ static void usage() {
            "    -  add  Add a new acronym to the current list\n"
            "    -  search search-string Show all acronyms in the list that "
            "contains the given search string\n"
+           "    -  prefix text Show the most frequent acronyms and description "
+           "words starting with the given text\n"
            "    -  delete an-acronym    Delete a given acronym from the list\n"
            "    -  save Save the current list of acronyms back to the data "
            "file list";
@@ -202,6 +1270,10 @@ int AcronymLookup(int argc, const char *argv[]) {
                 string arg;
                 cin >> arg;
                 acronyms.search(arg);
+            } else if (cmd == "prefix") {
+                string arg;
+                cin >> arg;
+                acronyms.prefix(arg);
             } else if (cmd == "add") {
                 cout << "Please enter an acronym name: ";
                 string acro;
@@ -7,12 +7,73 @@
  *
  * To compile:
  * clang++ src/transact_stocks.cpp -o TransactStocks
+ *
+ * To run:
+ * TransactStocks [--jobs N] [--journal FILE]
+ *                [--journal-latency-us N] [--compact-mb N] [--stats-file FILE]
+ *                [transactions_file|snapshot...]
+ * TransactStocks --summary-only [--jobs N] [--stats-file FILE]
+ *                [transactions_file|-...]
+ *
+ * Lines of a transactions file may end with a timestamp in milliseconds since
+ * the epoch, which the bars and vwap commands use. Prices are kept to four
+ * decimals and notionals and summary totals are exact. Amounts print rounded
+ * to cents as their nearest double rounds, as when they were held as
+ * doubles, but summary totals are exact sums and may differ by a cent from
+ * the drifting double sums printed before.
+ *
+ * --jobs N: Parse transactions files on N threads
+ * --journal FILE: Make buy, sell and load durable in FILE, replayed at startup
+ * --journal-latency-us N: Group commit waits at most N microseconds (500)
+ * --compact-mb N: Compact the journal into FILE.snap past N MB (64)
+ * --summary-only: Print the summary and per-symbol totals of the files, or
+ *                 stdin for '-' or no file, in one pass and exit
+ * --stats-file FILE: Write row counters and command latencies to FILE on exit
+ *
+ * Statistics, the stats command and --stats-file are left out when built
+ * with TRANSACT_STOCKS_NO_STATS defined.
+ *
+ * To benchmark, build with TRANSACT_STOCKS_BENCH defined (the
+ * bench_transact_stocks target) and run:
+ * bench_transact_stocks [--rows N] [--symbols N] [--invalid-rate F]
+ *                       [--jobs N] [--iterations N] [--seed N]
+ *
+ * Results are written to stdout as JSON.
  */
 
+#include <fcntl.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <exception>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
@@ -26,22 +87,7 @@ private:
 
     static string errorMessage(int error, const string &msg) {
         ostringstream oss;
-        oss << "Error: ";
-        switch (error) {
-        case ERROR_INVALID_PRICE:
-            oss << "Invalid price. ";
-            break;
-        case ERROR_INVALID_SYMBOL:
-            oss << "Invalid symbol. ";
-            break;
-        case ERROR_INVALID_QUANTITY:
-            oss << "Invalid quantity. ";
-            break;
-        default:
-            break;
-        }
-        oss << msg;
-
+        write(oss, error, msg);
         return oss.str();
     }
 
@@ -50,6 +96,54 @@ public:
     static const int ERROR_INVALID_PRICE = -1;
     static const int ERROR_INVALID_SYMBOL = -2;
     static const int ERROR_INVALID_QUANTITY = -3;
+    static const int ERROR_MALFORMED_RECORD = -4;
+    static const int ERROR_INVALID_SNAPSHOT = -5;
+    static const int ERROR_JOURNAL_FAILURE = -6;
+    static const int ERROR_AMOUNT_OVERFLOW = -7;
+
+    /**
+     * Write the message of an error without raising it, as what() would
+     * return it
+     *
+     * @param out Stream to write to
+     * @param error Error code
+     * @param msg Detail appended to the description of the error
+     */
+    static void write(ostream &out, int error, const string &msg) {
+        out << "Error: ";
+        const char *description = describe(error);
+        if (*description) {
+            out << description << ". ";
+        }
+        out << msg;
+    }
+
+    /**
+     * Short description of an error code
+     *
+     * @param error Error code
+     * @return Description, empty for unknown codes
+     */
+    static const char *describe(int error) {
+        switch (error) {
+        case ERROR_INVALID_PRICE:
+            return "Invalid price";
+        case ERROR_INVALID_SYMBOL:
+            return "Invalid symbol";
+        case ERROR_INVALID_QUANTITY:
+            return "Invalid quantity";
+        case ERROR_MALFORMED_RECORD:
+            return "Malformed record";
+        case ERROR_INVALID_SNAPSHOT:
+            return "Invalid snapshot";
+        case ERROR_JOURNAL_FAILURE:
+            return "Journal failure";
+        case ERROR_AMOUNT_OVERFLOW:
+            return "Amount overflow";
+        default:
+            return "";
+        }
+    }
 
     /**
      * Get the actual error code for custom handling of errors
@@ -63,315 +157,5997 @@ public:
 };
 
 /**
- * Implements the base class with common properties to model different stock
- * transactions.
+ * Process wide table assigning dense 32-bit ids to stock symbols, so that
+ * every distinct symbol is stored once no matter how many transactions refer
+ * to it and symbols compare and group as integers.
  *
- * Performs validation on constructor inputs and throws StockException in errors
+ * Symbols are stored in fixed size blocks that never move, which makes
+ * resolving an id lock-free. Lookups by name go to one of SHARDS open
+ * addressing hash tables of ids; reading a shard is lock-free as well, only
+ * inserting a new symbol takes the lock of its shard. A shard that grows
+ * publishes a new table and keeps the old one alive for concurrent readers.
+ * New ids are assigned under one more lock and counted by size() only once
+ * their string is stored, so every id below size() resolves.
  */
-class Stock {
+class SymbolTable {
 private:
-    size_t _numShares;
-    const string _symbol;
-    double _pricePerShare;
+    static const size_t SHARDS = 64;
+    static const size_t BLOCK_BITS = 12;
+    static const size_t BLOCK_SIZE = (size_t)1 << BLOCK_BITS;
+    static const size_t MAX_BLOCKS = (size_t)1 << 14;
 
-public:
-    static const int BUY = 1;
-    static const int SELL = 2;
+    // Hash table slots hold id + 1, zero marks an empty slot
+    struct Table {
+        const size_t mask;
+        unique_ptr<atomic<uint32_t>[]> slots;
 
-    // Base class destructor should be virtual to ensure derived class
-    // destructor gets invoked when deleting a derived class pointer stored as a
-    // base class pointer
-    virtual ~Stock() = default;
+        explicit Table(size_t capacity)
+            : mask(capacity - 1), slots(new atomic<uint32_t>[capacity]) {
+            for (size_t i = 0; i < capacity; ++i) {
+                slots[i].store(0, memory_order_relaxed);
+            }
+        }
+    };
 
-    size_t getNumberOfShares() const { return _numShares; }
+    struct alignas(64) Shard {
+        mutex lock;
+        atomic<Table *> table{nullptr};
+        // Current table last, older tables are retired but kept alive
+        vector<unique_ptr<Table>> tables;
+        size_t count = 0;
+    };
 
-    const string &getSymbol() const { return _symbol; }
+    Shard _shards[SHARDS];
+    atomic<string *> _blocks[MAX_BLOCKS];
 
-    double getPricePerShare() const { return _pricePerShare; }
+    // Ids with a stored string, the next id is assigned under _assignLock
+    mutex _assignLock;
+    atomic<uint32_t> _size{0};
 
-    virtual int getTransactionType() const = 0;
+    static uint64_t hash(const char *symbol, size_t length) {
+        // FNV-1a
+        uint64_t value = 14695981039346656037ULL;
+        for (size_t i = 0; i < length; ++i) {
+            value = (value ^ (unsigned char)symbol[i]) * 1099511628211ULL;
+        }
+        return value;
+    }
+
+    static bool equals(const string &str, const char *symbol, size_t length) {
+        return str.size() == length && 0 == memcmp(str.data(), symbol, length);
+    }
 
     /**
-     * Constructor performs input validations and throws StockException on
-     * errors
+     * Probe a table for a symbol
      *
-     * @param numShares Number of shares to buy/sell, positive value
-     * @param symbol Stock symbol, non empty string
-     * @param pricePerShare Price per share, positive value
+     * @return id + 1 of the symbol, or 0 when the probe hit an empty slot
      */
-    Stock(int numShares, const string &symbol, double pricePerShare)
-        : _symbol(symbol) {
-        if (numShares < 0) {
-            throw StockException(StockException::ERROR_INVALID_QUANTITY,
-                                 "Ignored");
+    uint32_t probe(const Table &table, uint64_t code, const char *symbol,
+                   size_t length) const {
+        for (size_t i = code & table.mask;; i = (i + 1) & table.mask) {
+            const uint32_t slot = table.slots[i].load(memory_order_acquire);
+            if (!slot || equals(this->symbol(slot - 1), symbol, length)) {
+                return slot;
+            }
         }
+    }
 
-        if (pricePerShare < 0.0) {
-            throw StockException(StockException::ERROR_INVALID_PRICE,
-                                 "Ignored");
+    static void place(Table &table, uint64_t code, uint32_t slot) {
+        size_t i = code & table.mask;
+        while (table.slots[i].load(memory_order_relaxed)) {
+            i = (i + 1) & table.mask;
         }
+        table.slots[i].store(slot, memory_order_release);
+    }
 
-        if (symbol.empty() || symbol.find_first_not_of(" \t") == string::npos) {
-            throw StockException(StockException::ERROR_INVALID_SYMBOL,
-                                 "Ignored");
+    /**
+     * Assign the next id to a symbol and store its string, allocating its
+     * block on first use. The id is published only once the string is
+     * stored, and not consumed if storing fails.
+     */
+    uint32_t assign(const char *symbol, size_t length) {
+        lock_guard<mutex> guard(_assignLock);
+        const uint32_t id = _size.load(memory_order_relaxed);
+        if ((id >> BLOCK_BITS) >= MAX_BLOCKS) {
+            throw length_error("Too many distinct stock symbols");
         }
 
-        _numShares = numShares;
-        _pricePerShare = pricePerShare;
+        atomic<string *> &block = _blocks[id >> BLOCK_BITS];
+        string *strings = block.load(memory_order_relaxed);
+        if (!strings) {
+            strings = new string[BLOCK_SIZE];
+            block.store(strings, memory_order_release);
+        }
+        strings[id & (BLOCK_SIZE - 1)].assign(symbol, length);
+
+        _size.store(id + 1, memory_order_release);
+        return id;
     }
 
     /**
-     * Generic string representation of Stock instance
-     *
-     * @return String representation
+     * Insert a symbol into its shard, the shard lock must be held
      */
-    virtual string toString() const {
-        ostringstream oss;
-        oss << fixed;
-        oss << "TYPE(" << (getTransactionType() == BUY ? "buy" : "sell")
-            << ") SYMBOL(" << getSymbol() << ") PRICE($" << setprecision(2)
-            << getPricePerShare() << ") QUANTITY(" << getNumberOfShares()
-            << ") TOTAL($" << setprecision(2)
-            << (getPricePerShare() * (double)getNumberOfShares()) << ")";
-        return oss.str();
-    }
-};
+    uint32_t insert(Shard &shard, uint64_t code, const char *symbol,
+                    size_t length) {
+        Table *current = shard.table.load(memory_order_relaxed);
+        if (current) {
+            const uint32_t slot = probe(*current, code, symbol, length);
+            if (slot) {
+                return slot - 1;
+            }
+        }
 
-/**
- * Specializes Stock to support purchase/buy transaction
- */
-class BuyTransaction : public Stock {
-public:
-    BuyTransaction(int numShares, const string &symbol, double pricePerShare)
-        : Stock(numShares, symbol, pricePerShare) {}
+        const uint32_t id = assign(symbol, length);
 
-    int getTransactionType() const override { return Stock::BUY; }
-};
+        // Keep the load factor at or below one half
+        if (!current || (shard.count + 1) * 2 > current->mask + 1) {
+            unique_ptr<Table> grown(
+                new Table(current ? (current->mask + 1) * 2 : 16));
+            if (current) {
+                for (size_t i = 0; i <= current->mask; ++i) {
+                    const uint32_t slot =
+                        current->slots[i].load(memory_order_relaxed);
+                    if (slot) {
+                        const string &str = this->symbol(slot - 1);
+                        place(*grown, hash(str.data(), str.size()), slot);
+                    }
+                }
+            }
 
-/**
- * Specializes Stock to support sell transaction
- */
-class SellTransaction : public Stock {
-public:
-    SellTransaction(int numShares, const string &symbol, double pricePerShare)
-        : Stock(numShares, symbol, pricePerShare) {}
-    int getTransactionType() const override { return Stock::SELL; }
-};
+            shard.tables.push_back(move(grown));
+            current = shard.tables.back().get();
+            place(*current, code, id + 1);
+            shard.table.store(current, memory_order_release);
+        } else {
+            place(*current, code, id + 1);
+        }
 
-/**
- * Class implementing various commands and orchestration of stock transactions
- */
-class Transactions {
-private:
-    // Allows reading/writing to file instead of console
-    istream &input;
-    ostream &output;
+        ++shard.count;
+        return id;
+    }
 
-    // All valid transactions performed so far
-    vector<Stock *> _transactions;
+    SymbolTable() {
+        for (auto &block : _blocks) {
+            block.store(nullptr, memory_order_relaxed);
+        }
+    }
+
+public:
+    SymbolTable(const SymbolTable &) = delete;
+    SymbolTable &operator=(const SymbolTable &) = delete;
+
+    ~SymbolTable() {
+        for (auto &block : _blocks) {
+            delete[] block.load(memory_order_relaxed);
+        }
+    }
 
     /**
-     * Show usage details
+     * The table shared by all transactions
      */
-    void usage() {
-        output << "usage: " << endl;
-        output << "\tbuy - Start a stock purchase/buy transaction" << endl;
-        output << "\tsell - Start a stock sell transaction" << endl;
-        output << "\tdisplay - Display all transactions" << endl;
-        output << "\tsummary - Display summary of buy & sell transactions"
-               << endl;
-        output << "\texit - Quit the application." << endl;
-        output << "\thelp - Display this help message" << endl;
+    static SymbolTable &global() {
+        static SymbolTable table;
+        return table;
     }
 
     /**
-     * Implements stock buy/purchase command
+     * Get the id of a symbol, assigning the next free id if it is new. Safe to
+     * call from multiple threads.
+     *
+     * @param symbol Stock symbol, need not be null terminated
+     * @param length Length of the symbol
+     * @return Dense id of the symbol
      */
-    bool buy() {
-        bool status = false;
+    uint32_t intern(const char *symbol, size_t length) {
+        const uint64_t code = hash(symbol, length);
+        Shard &shard = _shards[code >> 58];
 
-        output << "Enter stock symbol to buy: ";
-        string symbol;
-        input >> symbol;
+        const Table *table = shard.table.load(memory_order_acquire);
+        if (table) {
+            const uint32_t slot = probe(*table, code, symbol, length);
+            if (slot) {
+                return slot - 1;
+            }
+        }
 
-        output << "Enter number of shares to buy: ";
-        int numShares;
-        input >> numShares;
+        lock_guard<mutex> guard(shard.lock);
+        return insert(shard, code, symbol, length);
+    }
 
-        output << "Enter price per share: ";
-        double pricePerShare;
-        input >> pricePerShare;
+    uint32_t intern(const string &symbol) {
+        return intern(symbol.data(), symbol.size());
+    }
 
-        try {
-            _transactions.push_back(
-                new BuyTransaction(numShares, symbol, pricePerShare));
-            status = true;
-        } catch (const StockException &ex) {
-            output << ex.what() << endl;
+    /**
+     * Look up the id of a symbol without interning it
+     *
+     * @param symbol Stock symbol
+     * @param id Set to the id of the symbol when found
+     * @return true if the symbol is known
+     */
+    bool find(const string &symbol, uint32_t &id) const {
+        const uint64_t code = hash(symbol.data(), symbol.size());
+        const Table *table =
+            _shards[code >> 58].table.load(memory_order_acquire);
+        const uint32_t slot =
+            table ? probe(*table, code, symbol.data(), symbol.size()) : 0;
+        if (!slot) {
+            return false;
         }
 
-        return status;
+        id = slot - 1;
+        return true;
     }
 
     /**
-     * Implements stock sell transaction
+     * Resolve an id returned by intern() back to its symbol, lock-free
      */
-    bool sell() {
-        bool status = false;
-
-        output << "Enter stock symbol to sell: ";
-        string symbol;
-        input >> symbol;
+    const string &symbol(uint32_t id) const {
+        return _blocks[id >> BLOCK_BITS].load(
+            memory_order_acquire)[id & (BLOCK_SIZE - 1)];
+    }
 
-        output << "Enter number of shares to sell: ";
-        int numShares;
-        input >> numShares;
+    /**
+     * Number of ids assigned so far, all of which resolve through symbol()
+     */
+    size_t size() const { return _size.load(memory_order_acquire); }
+};
 
-        output << "Enter price per share: ";
-        double pricePerShare;
-        input >> pricePerShare;
+/**
+ * Formatting of numbers straight into a string, in the style of to_chars.
+ * Avoids the locale and stream state machinery of iostreams while producing
+ * the same characters as the stream manipulators named below.
+ */
+class TextFormat {
+private:
+    static const char DIGIT_PAIRS[201];
 
-        try {
-            _transactions.push_back(
-                new SellTransaction(numShares, symbol, pricePerShare));
-            status = true;
-        } catch (const StockException &ex) {
-            output << ex.what() << endl;
+public:
+    /**
+     * Append an unsigned integer, as operator<< would
+     */
+    static void appendUnsigned(string &out, uint64_t value) {
+        char digits[20];
+        char *ptr = digits + sizeof(digits);
+        while (value >= 100) {
+            ptr -= 2;
+            memcpy(ptr, DIGIT_PAIRS + 2 * (value % 100), 2);
+            value /= 100;
         }
-
-        return status;
+        if (value >= 10) {
+            ptr -= 2;
+            memcpy(ptr, DIGIT_PAIRS + 2 * value, 2);
+        } else {
+            *--ptr = (char)('0' + value);
+        }
+        out.append(ptr, (size_t)(digits + sizeof(digits) - ptr));
     }
 
     /**
-     * Implements command to display all stock transactions
+     * Append a whole number of cents as units with two decimals
      */
-    void display() {
-        for (auto ptr : _transactions) {
-            output << "\t" << ptr->toString() << endl;
-        }
+    static void appendCents(string &out, uint64_t cents) {
+        appendUnsigned(out, cents / 100);
+        out += '.';
+        out.append(DIGIT_PAIRS + 2 * (cents % 100), 2);
     }
 
     /**
-     * Implements displaying the summary of buy & sell transactions
+     * Append a value with two decimals, as fixed << setprecision(2) would
      */
-    void summary() {
-        size_t totalBuyTransactions = 0, totalSellTransactions = 0;
-        double totalBuyPrice = 0.0, totalSellPrice = 0.0;
-
-        for (auto ptr : _transactions) {
-            if (ptr->getTransactionType() == Stock::BUY) {
-                totalBuyPrice += (ptr->getPricePerShare() *
-                                  (double)ptr->getNumberOfShares());
-                ++totalBuyTransactions;
-            } else if (ptr->getTransactionType() == Stock::SELL) {
-                totalSellPrice += (ptr->getPricePerShare() *
-                                   (double)ptr->getNumberOfShares());
-                ++totalSellTransactions;
+    static void appendFixed2(string &out, double value) {
+        // value * 100 is within half an ulp of the exact product, so unless
+        // it is about that close to a halfway point its rounding to a whole
+        // number of cents is the same as the exact product's. Negative, huge
+        // and halfway values go through snprintf.
+        if (value >= 0.0 && value < 1e13 && !signbit(value)) {
+            const double scaled = value * 100.0;
+            const double whole = floor(scaled);
+            const double fraction = scaled - whole;
+            if (fabs(fraction - 0.5) > scaled * 2.220446049250313e-16) {
+                appendCents(out, (uint64_t)whole + (fraction > 0.5 ? 1 : 0));
+                return;
             }
         }
 
-        output << fixed;
-        output << "\t";
-        output << "BUY-transactions(" << totalBuyTransactions << ") BUY-total($"
-               << setprecision(2) << totalBuyPrice << ")  SELL-transactions("
-               << totalSellTransactions << ") SELL-total($" << setprecision(2)
-               << totalSellPrice << ")" << endl;
+        char text[400];
+        const int length = snprintf(text, sizeof(text), "%.2f", value);
+        out.append(text, (size_t)max(0, length));
     }
+};
+
+const char TextFormat::DIGIT_PAIRS[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+
+/**
+ * Amount of money in a signed 64-bit count of ten-thousandths (ticks), so
+ * prices with up to four decimals and the totals summed from them are exact.
+ * The range is about +/-922 trillion. Products and sums are overflow checked
+ * and report failure instead of wrapping.
+ */
+class Money {
+private:
+    int64_t _ticks = 0;
 
 public:
-    Transactions() : Transactions(cin, cout) {}
-    Transactions(istream &in, ostream &out) : input(in), output(out) {}
+    static const int DECIMALS = 4;
+    static const int64_t SCALE = 10000;
+
+    Money() = default;
+
+    static Money fromTicks(int64_t ticks) {
+        Money money;
+        money._ticks = ticks;
+        return money;
+    }
 
     /**
-     * Free memory allocated to store transactions
+     * Nearest amount to a double, halfway cases rounded away from zero
+     *
+     * @param value Amount
+     * @param money Set to the amount on success
+     * @return false if the value is not a number or out of range
      */
-    virtual ~Transactions() {
-        for (auto ptr : _transactions) {
-            delete ptr;
+    static bool fromDouble(double value, Money &money) {
+        const double ticks = round(value * (double)SCALE);
+        // 2^63, the first double past the range
+        if (!(fabs(ticks) < 9223372036854775808.0)) {
+            return false;
         }
+
+        money._ticks = (int64_t)ticks;
+        return true;
     }
 
     /**
-     * Main command loop with user interaction to perform various stock
-     * transactions
+     * Parse a plain decimal such as "-12.345" without going through a double.
+     * Digits past the fourth decimal round half away from zero.
+     *
+     * @param begin Start of the token
+     * @param end End of the token
+     * @param money Set to the amount on success
+     * @return false if the token is not a plain decimal, out of range, or
+     * below zero but rounds to zero
      */
-    void run() {
-        string cmd = "help";
-        output << endl;
+    static bool parse(const char *begin, const char *end, Money &money) {
+        static const uint64_t POW10[DECIMALS + 1] = {1, 10, 100, 1000, 10000};
+        const uint64_t MAX_WHOLE = (uint64_t)INT64_MAX / SCALE;
 
-        while ("exit" != cmd) {
-            if ("help" == cmd) {
-                usage();
-            } else if ("buy" == cmd) {
-                buy();
-            } else if ("sell" == cmd) {
-                sell();
-            } else if ("display" == cmd) {
-                display();
-            } else if ("summary" == cmd) {
-                summary();
-            } else if ("exit" != cmd) {
-                output << "Invalid command '" << cmd << "', please retry."
-                       << endl;
+        bool negative = false;
+        if (begin != end && ('-' == *begin || '+' == *begin)) {
+            negative = '-' == *begin;
+            ++begin;
+        }
+
+        uint64_t whole = 0, fraction = 0;
+        int decimals = 0;
+        bool seenDot = false, seenDigit = false, seenNonZero = false,
+             roundUp = false;
+        for (; begin != end; ++begin) {
+            const unsigned digit = (unsigned)(*begin - '0');
+            if (digit <= 9) {
+                seenDigit = true;
+                seenNonZero |= 0 != digit;
+                if (!seenDot) {
+                    if (whole > (MAX_WHOLE - digit) / 10) {
+                        return false;
+                    }
+                    whole = whole * 10 + digit;
+                } else if (decimals < DECIMALS) {
+                    fraction = fraction * 10 + digit;
+                    ++decimals;
+                } else if (DECIMALS == decimals) {
+                    // The first dropped digit decides the rounding
+                    roundUp = digit >= 5;
+                    ++decimals;
+                }
+            } else if ('.' == *begin && !seenDot) {
+                seenDot = true;
+            } else {
+                return false;
             }
+        }
 
-            output << endl
-                   << "Enter a command, ('help' for usage OR 'exit' to quit): ";
-            input >> cmd;
+        const int kept = decimals < DECIMALS ? decimals : DECIMALS;
+        const uint64_t ticks =
+            whole * SCALE + fraction * POW10[DECIMALS - kept] + roundUp;
+        if (!seenDigit || ticks > (uint64_t)INT64_MAX ||
+            (negative && seenNonZero && 0 == ticks)) {
+            return false;
         }
+
+        money._ticks = negative ? -(int64_t)ticks : (int64_t)ticks;
+        return true;
     }
 
     /**
-     * Optionally load transactions from a file
-     *
-     * Contains multiple lines in the below format
-     * transaction_type  quantity symbol price_per_share
+     * Multiply a price by a number of shares
      *
-     * transaction_type: Integer, 1 (buy) or 2 (sell)
-     * quantity: Integer, number of shares to transact
-     * symbol: String, stock symbol
-     * price_per_share: Double, price per share in '$'
+     * @param price Price per share
+     * @param quantity Number of shares
+     * @param product Set to the notional on success
+     * @return false on overflow
+     */
+    static bool multiply(Money price, uint64_t quantity, Money &product) {
+        int64_t ticks;
+        if (quantity > (uint64_t)INT64_MAX ||
+            __builtin_mul_overflow(price._ticks, (int64_t)quantity, &ticks)) {
+            return false;
+        }
+
+        product._ticks = ticks;
+        return true;
+    }
+
+    /**
+     * Add an amount in place
      *
-     * @param in Input file stream with stock transactions
+     * @return false on overflow, leaving the amount unchanged
      */
-    void load(ifstream &in) {
-        while (in.good()) {
-            int type;
-            in >> type;
+    bool add(Money amount) {
+        int64_t ticks;
+        if (__builtin_add_overflow(_ticks, amount._ticks, &ticks)) {
+            return false;
+        }
 
-            int quantity;
-            in >> quantity;
+        _ticks = ticks;
+        return true;
+    }
 
-            string sym;
-            in >> sym;
+    int64_t ticks() const { return _ticks; }
 
-            double price;
-            in >> price;
+    double toDouble() const { return (double)_ticks / (double)SCALE; }
 
-            try {
-                if (Stock::BUY == type) {
-                    _transactions.push_back(
-                        new BuyTransaction(quantity, sym, price));
-                } else if (Stock::SELL == type) {
-                    _transactions.push_back(
-                        new SellTransaction(quantity, sym, price));
-                }
-            } catch (const StockException &ex) {
-                output << ex.what() << endl;
-            }
+    bool operator==(Money other) const { return _ticks == other._ticks; }
 
-            // Note: The file handle becomes bad only when you try to read
-            // beyond a file Read a character and if the file still has more
-            // data to process, add it back into stream. If the file handle
-            // becomes bad, we have reached the end
-            char ch;
-            in >> ch;
-            if (in.good()) {
-                in.putback(ch);
-            }
+    bool operator!=(Money other) const { return _ticks != other._ticks; }
+
+    bool operator<(Money other) const { return _ticks < other._ticks; }
+
+    /**
+     * Append the amount with two decimals, rounded as fixed << setprecision(2)
+     * rounds the nearest double, so amounts print as they did when they were
+     * held as doubles: 1.015 is just below its double and prints as 1.01
+     */
+    void appendFixed2(string &out) const {
+        const uint64_t TICKS_PER_CENT = SCALE / 100;
+        const uint64_t magnitude =
+            _ticks < 0 ? 0 - (uint64_t)_ticks : (uint64_t)_ticks;
+        const uint64_t rest = magnitude % TICKS_PER_CENT;
+
+        // Below 2^50 ticks a double is within a fraction of a tick of the
+        // amount, so only halfway amounts can round differently from it
+        if (_ticks < 0 || magnitude >= (1ULL << 50) ||
+            2 * rest == TICKS_PER_CENT) {
+            TextFormat::appendFixed2(out, toDouble());
+            return;
         }
+
+        TextFormat::appendCents(out, magnitude / TICKS_PER_CENT +
+                                         (2 * rest > TICKS_PER_CENT ? 1 : 0));
     }
-};
+
+    /**
+     * The amount as appendFixed2() writes it
+     */
+    string toFixed2() const {
+        string str;
+        appendFixed2(str);
+        return str;
+    }
+};
+
+static_assert(sizeof(Money) == sizeof(int64_t),
+              "Money columns are stored as raw ticks");
+
+#if defined(TRANSACT_STOCKS_NO_STATS)
+#define STATS_ENABLED 0
+#else
+#define STATS_ENABLED 1
+#endif
+
+#if STATS_ENABLED
+
+/**
+ * Log-linear histogram of durations in nanoseconds, in the style of
+ * HdrHistogram. Values below 64 get a bucket each, larger ones share buckets
+ * 1/32 of a power of two wide, so every recorded value is known within about
+ * 3% with a fixed 15 KB of counters and O(1) recording.
+ */
+class LatencyHistogram {
+private:
+    static const int SUB_BITS = 5;
+    static const uint64_t SUB_BUCKETS = (uint64_t)1 << SUB_BITS;
+    static const size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    uint64_t _counts[BUCKETS] = {};
+    uint64_t _count = 0;
+    uint64_t _sum = 0;
+    uint64_t _max = 0;
+
+    static size_t bucket(uint64_t value) {
+        if (value < 2 * SUB_BUCKETS) {
+            return (size_t)value;
+        }
+
+        // Keep the top SUB_BITS + 1 bits, the highest one is implied
+        const int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (size_t)((uint64_t)shift * SUB_BUCKETS + (value >> shift));
+    }
+
+    /**
+     * Largest value that falls in a bucket
+     */
+    static uint64_t highest(size_t index) {
+        if (index < 2 * SUB_BUCKETS) {
+            return index;
+        }
+
+        const int shift = (int)(index / SUB_BUCKETS) - 1;
+        const uint64_t mantissa = index % SUB_BUCKETS + SUB_BUCKETS;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+public:
+    void record(uint64_t nanos) {
+        ++_counts[bucket(nanos)];
+        ++_count;
+        _sum += nanos;
+        _max = max(_max, nanos);
+    }
+
+    uint64_t count() const { return _count; }
+
+    uint64_t mean() const { return _count ? _sum / _count : 0; }
+
+    uint64_t maximum() const { return _max; }
+
+    /**
+     * Value at or below which the given fraction of the values fall, rounded
+     * up to the end of its bucket
+     *
+     * @param fraction Between 0 and 1
+     */
+    uint64_t percentile(double fraction) const {
+        const uint64_t rank =
+            max((uint64_t)1, (uint64_t)ceil(fraction * (double)_count));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += _counts[i];
+            if (seen >= rank) {
+                return min(highest(i), _max);
+            }
+        }
+        return _max;
+    }
+};
+
+/**
+ * Counters and latency histograms of the work done by Transactions: one
+ * histogram per command and per load stage, rows accepted and rejected per
+ * StockException error code, and bytes of text parsed. Row counters may be
+ * bumped from any thread, histograms only from the command loop thread.
+ *
+ * Defining TRANSACT_STOCKS_NO_STATS turns STATS_ENABLED off, which leaves
+ * out this class, its member, its clock reads and the stats command.
+ */
+class Stats {
+private:
+    // Error codes run from -1 down to -MAX_ERRORS
+    static const int MAX_ERRORS = 8;
+
+    // Histograms in order of first use
+    vector<pair<string, unique_ptr<LatencyHistogram>>> _histograms;
+
+    atomic<uint64_t> _validRows{0};
+    atomic<uint64_t> _bytesParsed{0};
+    atomic<uint64_t> _rejectedRows[MAX_ERRORS];
+
+public:
+    Stats() {
+        for (auto &rejected : _rejectedRows) {
+            rejected.store(0, memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Nanoseconds elapsed since a steady_clock time point
+     */
+    static uint64_t since(chrono::steady_clock::time_point start) {
+        return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+                   chrono::steady_clock::now() - start)
+            .count();
+    }
+
+    /**
+     * Histogram of the given name, created on first use
+     */
+    LatencyHistogram &histogram(const string &name) {
+        for (auto &entry : _histograms) {
+            if (entry.first == name) {
+                return *entry.second;
+            }
+        }
+
+        _histograms.emplace_back(name, unique_ptr<LatencyHistogram>(
+                                           new LatencyHistogram()));
+        return *_histograms.back().second;
+    }
+
+    void addValid(uint64_t rows) {
+        _validRows.fetch_add(rows, memory_order_relaxed);
+    }
+
+    void addParsed(uint64_t bytes) {
+        _bytesParsed.fetch_add(bytes, memory_order_relaxed);
+    }
+
+    /**
+     * @param code StockException error code the rows were rejected with
+     * @param rows Number of rows
+     */
+    void addRejected(int code, uint64_t rows = 1) {
+        if (code < 0 && code >= -MAX_ERRORS) {
+            _rejectedRows[-code - 1].fetch_add(rows, memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Write all counters and histograms, durations in microseconds
+     */
+    void report(ostream &stream) const {
+        // Formatted apart so the stream's own flags are left alone
+        ostringstream out;
+        out << "\tROWS-VALID(" << _validRows.load() << ") BYTES-PARSED("
+            << _bytesParsed.load() << ")" << endl;
+        for (int i = 0; i < MAX_ERRORS; ++i) {
+            const uint64_t rows = _rejectedRows[i].load();
+            if (rows) {
+                out << "\tROWS-REJECTED(" << StockException::describe(-i - 1)
+                    << ") COUNT(" << rows << ")" << endl;
+            }
+        }
+
+        out << fixed << setprecision(1);
+        for (const auto &entry : _histograms) {
+            const LatencyHistogram &histogram = *entry.second;
+            out << "\tLATENCY(" << entry.first << ") COUNT("
+                << histogram.count() << ") MEAN(" << histogram.mean() / 1e3
+                << "us) P50(" << histogram.percentile(0.5) / 1e3 << "us) P90("
+                << histogram.percentile(0.9) / 1e3 << "us) P99("
+                << histogram.percentile(0.99) / 1e3 << "us) MAX("
+                << histogram.maximum() / 1e3 << "us)" << endl;
+        }
+        stream << out.str();
+    }
+};
+#endif
+
+/**
+ * Implements the base class with common properties to model different stock
+ * transactions.
+ *
+ * Performs validation on constructor inputs and throws StockException in errors
+ */
+class Stock {
+private:
+    size_t _numShares;
+    uint32_t _symbolId;
+    Money _pricePerShare;
+    int64_t _timestamp;
+
+public:
+    static const int BUY = 1;
+    static const int SELL = 2;
+
+    // Timestamp of transactions recorded without one
+    static const int64_t NO_TIMESTAMP = INT64_MIN;
+
+    // Longest symbol, as journal records store its length in 16 bits
+    static const size_t MAX_SYMBOL_LENGTH = 65535;
+
+    // Base class destructor should be virtual to ensure derived class
+    // destructor gets invoked when deleting a derived class pointer stored as a
+    // base class pointer
+    virtual ~Stock() = default;
+
+    size_t getNumberOfShares() const { return _numShares; }
+
+    const string &getSymbol() const {
+        return SymbolTable::global().symbol(_symbolId);
+    }
+
+    uint32_t getSymbolId() const { return _symbolId; }
+
+    /**
+     * Time of the transaction in milliseconds since the epoch
+     *
+     * @return Timestamp, NO_TIMESTAMP if the transaction has none
+     */
+    int64_t getTimestamp() const { return _timestamp; }
+
+    Money getPricePerShare() const { return _pricePerShare; }
+
+    virtual int getTransactionType() const = 0;
+
+    /**
+     * Constructor performs input validations and throws StockException on
+     * errors
+     *
+     * @param numShares Number of shares to buy/sell, positive value
+     * @param symbol Stock symbol, non empty string
+     * @param pricePerShare Price per share, positive value, rounded to
+     * Money::DECIMALS decimals
+     * @param timestamp Optional time in milliseconds since the epoch
+     */
+    Stock(int numShares, const string &symbol, double pricePerShare,
+          int64_t timestamp = NO_TIMESTAMP)
+        : _timestamp(timestamp) {
+        const Money price = toPrice(pricePerShare);
+        const int error =
+            validate(numShares, symbol.data(), symbol.size(), price);
+        if (error) {
+            throw StockException(error, "Ignored");
+        }
+
+        _numShares = numShares;
+        _symbolId = SymbolTable::global().intern(symbol);
+        _pricePerShare = price;
+    }
+
+    /**
+     * Convert a price typed as a double. Prices below zero, even those that
+     * round to zero ticks, and prices that are not a number or out of range
+     * come back negative so that validate() rejects them in its usual order.
+     */
+    static Money toPrice(double pricePerShare) {
+        Money price;
+        return pricePerShare >= 0 && Money::fromDouble(pricePerShare, price)
+                   ? price
+                   : Money::fromTicks(-1);
+    }
+
+    /**
+     * Validate the inputs of a transaction without throwing, for bulk paths
+     * where rejected rows are common. Performs the same checks in the same
+     * order as the constructor.
+     *
+     * @param numShares Number of shares to buy/sell, positive value
+     * @param symbol Stock symbol, non empty string of at most
+     * MAX_SYMBOL_LENGTH bytes, need not be null terminated
+     * @param length Length of the symbol
+     * @param pricePerShare Price per share, positive value
+     * @return 0 if valid, else the StockException error code
+     */
+    static int validate(int numShares, const char *symbol, size_t length,
+                        Money pricePerShare) {
+        if (numShares < 0) {
+            return StockException::ERROR_INVALID_QUANTITY;
+        }
+
+        if (pricePerShare < Money()) {
+            return StockException::ERROR_INVALID_PRICE;
+        }
+
+        size_t i = 0;
+        while (i < length && (' ' == symbol[i] || '\t' == symbol[i])) {
+            ++i;
+        }
+        if (i == length || length > MAX_SYMBOL_LENGTH) {
+            return StockException::ERROR_INVALID_SYMBOL;
+        }
+
+        return 0;
+    }
+
+    /**
+     * Append the string representation of a transaction given its fields,
+     * used to format transactions that are not held as Stock instances
+     *
+     * @param out String to append to
+     * @param type Transaction type, BUY or SELL
+     * @param symbol Stock symbol
+     * @param pricePerShare Price per share
+     * @param numShares Number of shares
+     */
+    static void format(string &out, int type, const string &symbol,
+                       Money pricePerShare, size_t numShares) {
+        out += type == BUY ? "TYPE(buy) SYMBOL(" : "TYPE(sell) SYMBOL(";
+        out += symbol;
+        out += ") PRICE($";
+        pricePerShare.appendFixed2(out);
+        out += ") QUANTITY(";
+        TextFormat::appendUnsigned(out, numShares);
+        out += ") TOTAL($";
+        // Shown from the double product, as when prices were doubles, so
+        // half-cent totals such as 7 x 2.675 still round the same way
+        TextFormat::appendFixed2(out,
+                                 pricePerShare.toDouble() * (double)numShares);
+        out += ')';
+    }
+
+    /**
+     * Generic string representation of Stock instance
+     *
+     * @return String representation
+     */
+    virtual string toString() const {
+        string str;
+        format(str, getTransactionType(), getSymbol(), getPricePerShare(),
+               getNumberOfShares());
+        return str;
+    }
+};
+
+const int64_t Stock::NO_TIMESTAMP;
+
+/**
+ * Specializes Stock to support purchase/buy transaction
+ */
+class BuyTransaction : public Stock {
+public:
+    BuyTransaction(int numShares, const string &symbol, double pricePerShare,
+                   int64_t timestamp = NO_TIMESTAMP)
+        : Stock(numShares, symbol, pricePerShare, timestamp) {}
+
+    int getTransactionType() const override { return Stock::BUY; }
+};
+
+/**
+ * Specializes Stock to support sell transaction
+ */
+class SellTransaction : public Stock {
+public:
+    SellTransaction(int numShares, const string &symbol, double pricePerShare,
+                    int64_t timestamp = NO_TIMESTAMP)
+        : Stock(numShares, symbol, pricePerShare, timestamp) {}
+    int getTransactionType() const override { return Stock::SELL; }
+};
+
+/**
+ * Flush the data of an open file to stable storage
+ *
+ * @param fd File descriptor
+ * @return true on success
+ */
+static bool syncFile(int fd) {
+#if defined(__linux__)
+    return 0 == fdatasync(fd);
+#else
+    return 0 == fsync(fd);
+#endif
+}
+
+/**
+ * Flush the entries of the directory holding a file, such as the file being
+ * renamed into it, to stable storage
+ *
+ * @param fileName Path of the file
+ * @return true on success
+ */
+static bool syncDirectory(const string &fileName) {
+    const size_t slash = fileName.rfind('/');
+    const string directory =
+        string::npos == slash ? "." : fileName.substr(0, max(slash, (size_t)1));
+
+    const int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    const bool ok = 0 == fsync(fd);
+    ::close(fd);
+    return ok;
+}
+
+/**
+ * Read-only memory mapping of an entire file. The mapping is released when the
+ * instance goes out of scope.
+ */
+class MappedFile {
+private:
+    const char *_data = nullptr;
+    size_t _size = 0;
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() { close(); }
+
+    /**
+     * Map the given file into memory. Empty files map successfully with a
+     * null data pointer and zero size.
+     *
+     * @param fileName Path of the file to map
+     * @return true on success, false if the file could not be opened or mapped
+     */
+    bool open(const string &fileName) {
+        close();
+
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        bool status = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (status && st.st_size > 0) {
+            void *addr = mmap(nullptr, (size_t)st.st_size, PROT_READ,
+                              MAP_PRIVATE, fd, 0);
+            if (MAP_FAILED == addr) {
+                status = false;
+            } else {
+                _data = static_cast<const char *>(addr);
+                _size = (size_t)st.st_size;
+                // Records are consumed front to back exactly once
+                madvise(addr, _size, MADV_SEQUENTIAL);
+            }
+        }
+
+        ::close(fd);
+        return status;
+    }
+
+    void close() {
+        if (_data) {
+            munmap(const_cast<char *>(_data), _size);
+        }
+        _data = nullptr;
+        _size = 0;
+    }
+
+    const char *data() const { return _data; }
+
+    size_t size() const { return _size; }
+};
+
+/**
+ * Zero-copy scanner over an in-memory buffer of transaction records, one
+ * record per line in the format accepted by Transactions::load. Symbols are
+ * returned as pointers into the buffer and numbers are parsed in place without
+ * going through iostream.
+ */
+class RecordScanner {
+public:
+    struct Record {
+        int type;
+        int quantity;
+        const char *symbol;
+        size_t symbolLength;
+        Money price;
+        // Stock::NO_TIMESTAMP when the line has no timestamp
+        int64_t timestamp;
+        size_t line;
+    };
+
+    // Result of scanning the next line
+    static const int RECORD = 0;
+    static const int MALFORMED = 1;
+    static const int END = 2;
+
+private:
+    const char *_pos;
+    const char *_end;
+    size_t _line;
+
+    static bool isBlank(char ch) {
+        return ' ' == ch || '\t' == ch || '\r' == ch || '\v' == ch ||
+               '\f' == ch;
+    }
+
+    static bool isDigit(char ch) { return ch >= '0' && ch <= '9'; }
+
+    /**
+     * Parse a signed integer token that must lie within the given range
+     */
+    static bool parseInteger(const char *begin, const char *end,
+                             long long minValue, long long maxValue,
+                             long long &value) {
+        bool negative = false;
+        if (begin != end && ('-' == *begin || '+' == *begin)) {
+            negative = '-' == *begin;
+            ++begin;
+        }
+
+        if (begin == end) {
+            return false;
+        }
+
+        while (end - begin > 1 && '0' == *begin) {
+            ++begin;
+        }
+
+        // 19 digits always fit in 64 unsigned bits
+        if (end - begin > 19) {
+            return false;
+        }
+
+        unsigned long long result = 0;
+        for (; begin != end; ++begin) {
+            if (!isDigit(*begin)) {
+                return false;
+            }
+            result = result * 10 + (unsigned)(*begin - '0');
+        }
+
+        if (negative && result) {
+            // Magnitude of the most negative value allowed
+            const unsigned long long limit =
+                minValue < 0 ? (unsigned long long)(-(minValue + 1)) + 1 : 0;
+            if (result > limit) {
+                return false;
+            }
+            value = -(long long)(result - 1) - 1;
+        } else {
+            if (maxValue < 0 || result > (unsigned long long)maxValue) {
+                return false;
+            }
+            value = (long long)result;
+        }
+
+        return true;
+    }
+
+    static bool parseInt(const char *begin, const char *end, int &value) {
+        long long result;
+        if (!parseInteger(begin, end, INT_MIN, INT_MAX, result)) {
+            return false;
+        }
+
+        value = (int)result;
+        return true;
+    }
+
+    /**
+     * Parse a decimal price token. Plain decimals are converted straight to
+     * Money. Anything else operator>> would accept (exponents, and amounts
+     * below zero that round to zero) goes through strtod on a local copy of
+     * the token. A token that overflows a double is malformed, as it fails
+     * operator>>.
+     */
+    static bool parsePrice(const char *begin, const char *end, Money &value) {
+        if (Money::parse(begin, end, value)) {
+            return true;
+        }
+
+        // Only characters operator>> would accept as part of a double
+        for (const char *ptr = begin; ptr != end; ++ptr) {
+            if (!isDigit(*ptr) && !strchr(".eE+-", *ptr)) {
+                return false;
+            }
+        }
+
+        const size_t length = (size_t)(end - begin);
+        char buffer[64];
+        string longToken;
+        const char *token = buffer;
+        if (length < sizeof(buffer)) {
+            memcpy(buffer, begin, length);
+            buffer[length] = '\0';
+        } else {
+            longToken.assign(begin, length);
+            token = longToken.c_str();
+        }
+
+        char *parsed = nullptr;
+        errno = 0;
+        const double price = strtod(token, &parsed);
+        if (0 == length || parsed != token + length ||
+            (ERANGE == errno && HUGE_VAL == fabs(price))) {
+            return false;
+        }
+
+        // Prices below zero come back negative for validate() to report,
+        // even those that round to zero ticks
+        if (price < 0) {
+            value = Stock::toPrice(price);
+            return true;
+        }
+
+        return Money::fromDouble(price, value);
+    }
+
+public:
+    /**
+     * Count the newline characters in a buffer
+     *
+     * @param data Start of the buffer
+     * @param size Size of the buffer in bytes
+     * @return Number of '\n' characters
+     */
+    static size_t countLines(const char *data, size_t size) {
+        size_t lines = 0;
+        const char *end = data + size;
+        while (data < end) {
+            data = static_cast<const char *>(
+                memchr(data, '\n', (size_t)(end - data)));
+            if (!data) {
+                break;
+            }
+
+            ++lines;
+            ++data;
+        }
+
+        return lines;
+    }
+
+    /**
+     * @param data Start of the buffer, need not be null terminated
+     * @param size Size of the buffer in bytes
+     * @param firstLine Line number of the first line in the buffer
+     */
+    RecordScanner(const char *data, size_t size, size_t firstLine = 1)
+        : _pos(data), _end(data + size), _line(firstLine) {}
+
+    /**
+     * Line number of the next line to be scanned
+     */
+    size_t line() const { return _line; }
+
+    /**
+     * Scan the next non-blank line
+     *
+     * @param rec Filled in with the parsed record, line is set for malformed
+     * lines as well
+     * @return RECORD, MALFORMED or END
+     */
+    int next(Record &rec) {
+        while (_pos < _end) {
+            const char *eol = static_cast<const char *>(
+                memchr(_pos, '\n', (size_t)(_end - _pos)));
+            if (!eol) {
+                eol = _end;
+            }
+
+            const char *tokens[5][2];
+            int count = 0;
+            const char *ptr = _pos;
+            while (ptr < eol) {
+                while (ptr < eol && isBlank(*ptr)) {
+                    ++ptr;
+                }
+                if (ptr == eol) {
+                    break;
+                }
+
+                const char *start = ptr;
+                while (ptr < eol && !isBlank(*ptr)) {
+                    ++ptr;
+                }
+
+                if (count < 5) {
+                    tokens[count][0] = start;
+                    tokens[count][1] = ptr;
+                }
+                ++count;
+            }
+
+            rec.line = _line++;
+            _pos = eol < _end ? eol + 1 : _end;
+
+            if (0 == count) {
+                continue;
+            }
+
+            long long timestamp = Stock::NO_TIMESTAMP;
+            if ((4 == count ||
+                 (5 == count && parseInteger(tokens[4][0], tokens[4][1], 0,
+                                             LLONG_MAX, timestamp))) &&
+                parseInt(tokens[0][0], tokens[0][1], rec.type) &&
+                parseInt(tokens[1][0], tokens[1][1], rec.quantity) &&
+                parsePrice(tokens[3][0], tokens[3][1], rec.price)) {
+                rec.timestamp = timestamp;
+                rec.symbol = tokens[2][0];
+                rec.symbolLength = (size_t)(tokens[2][1] - tokens[2][0]);
+                return RECORD;
+            }
+
+            return MALFORMED;
+        }
+
+        return END;
+    }
+};
+
+/**
+ * Contiguous column of fixed size values that is either owned or a read-only
+ * view of external memory such as a mapped snapshot. A view is copied into
+ * owned storage the first time the column is modified.
+ */
+template <typename T> class Column {
+private:
+    vector<T> _owned;
+    const T *_data = nullptr;
+    size_t _size = 0;
+
+public:
+    /**
+     * Serve the column from external memory that outlives the view
+     */
+    void view(const T *data, size_t size) {
+        _owned.clear();
+        _owned.shrink_to_fit();
+        _data = data;
+        _size = size;
+    }
+
+    bool isView() const { return _size && _data != _owned.data(); }
+
+    /**
+     * Copy a view into owned storage
+     */
+    void materialize() {
+        if (isView()) {
+            _owned.assign(_data, _data + _size);
+            _data = _owned.data();
+        }
+    }
+
+    void push_back(T value) {
+        materialize();
+        _owned.push_back(value);
+        _data = _owned.data();
+        ++_size;
+    }
+
+    void append(const T *values, size_t count) {
+        materialize();
+        _owned.insert(_owned.end(), values, values + count);
+        _data = _owned.data();
+        _size += count;
+    }
+
+    void reserve(size_t count) {
+        materialize();
+        _owned.reserve(count);
+        _data = _owned.data();
+    }
+
+    /**
+     * Replace the contents with owned values
+     */
+    void assign(vector<T> &&values) {
+        _owned = move(values);
+        _data = _owned.data();
+        _size = _owned.size();
+    }
+
+    const T *data() const { return _data; }
+
+    size_t size() const { return _size; }
+};
+
+/**
+ * Column of transaction timestamps taking 4 bytes per transaction in the
+ * common case. Rows are grouped in blocks of BLOCK_SIZE. A block without any
+ * timestamp takes no memory, so rows recorded before the first timestamp cost
+ * nothing. Other blocks hold 32-bit offsets from their first timestamp,
+ * unless their timestamps span more than the 24 days such offsets reach, in
+ * which case they hold the timestamps in full.
+ *
+ * Like Column, it can be served from external memory, here a column of
+ * 64-bit timestamps, until it is appended to.
+ */
+class TimestampColumn {
+private:
+    static const size_t BLOCK_BITS = 16;
+    static const size_t BLOCK_SIZE = (size_t)1 << BLOCK_BITS;
+
+    // Offset of a row without a timestamp
+    static const int32_t NO_OFFSET = INT32_MIN;
+
+    struct Block {
+        // First timestamp of the block
+        int64_t base = 0;
+
+        // One per row from the first timestamp on, unless the block is wide
+        vector<int32_t> offsets;
+
+        // One per row once the block is wide
+        vector<int64_t> full;
+    };
+
+    vector<Block> _blocks;
+    size_t _size = 0;
+
+    // Set once a row has a timestamp
+    bool _timestamped = false;
+
+    // Timestamps served from external memory, nullptr if owned
+    const int64_t *_view = nullptr;
+
+    /**
+     * Start holding full timestamps in a block whose offsets overflow
+     */
+    static void widen(Block &block) {
+        block.full.reserve(BLOCK_SIZE);
+        for (int32_t offset : block.offsets) {
+            block.full.push_back(NO_OFFSET == offset
+                                     ? Stock::NO_TIMESTAMP
+                                     : block.base + offset);
+        }
+        vector<int32_t>().swap(block.offsets);
+    }
+
+    void add(int64_t timestamp) {
+        const size_t row = _size & (BLOCK_SIZE - 1);
+        if (!row) {
+            _blocks.emplace_back();
+        }
+        Block &block = _blocks.back();
+        ++_size;
+
+        if (!block.full.empty()) {
+            block.full.push_back(timestamp);
+            return;
+        }
+
+        if (Stock::NO_TIMESTAMP == timestamp) {
+            if (!block.offsets.empty()) {
+                block.offsets.push_back(NO_OFFSET);
+            }
+            return;
+        }
+
+        if (block.offsets.empty()) {
+            block.base = timestamp;
+            block.offsets.reserve(BLOCK_SIZE);
+            block.offsets.assign(row, NO_OFFSET);
+            _timestamped = true;
+        }
+
+        int64_t offset;
+        if (__builtin_sub_overflow(timestamp, block.base, &offset) ||
+            offset <= NO_OFFSET || offset > INT32_MAX) {
+            widen(block);
+            block.full.push_back(timestamp);
+        } else {
+            block.offsets.push_back((int32_t)offset);
+        }
+    }
+
+    /**
+     * Append rows without a timestamp
+     */
+    void pad(size_t count) {
+        while (count) {
+            const size_t row = _size & (BLOCK_SIZE - 1);
+            if (!row) {
+                _blocks.emplace_back();
+            }
+            Block &block = _blocks.back();
+            const size_t rows = min(count, BLOCK_SIZE - row);
+            if (!block.full.empty()) {
+                block.full.insert(block.full.end(), rows, Stock::NO_TIMESTAMP);
+            } else if (!block.offsets.empty()) {
+                block.offsets.insert(block.offsets.end(), rows, NO_OFFSET);
+            }
+            _size += rows;
+            count -= rows;
+        }
+    }
+
+public:
+    /**
+     * Serve the column from external memory that outlives the view
+     *
+     * @param data Timestamps, nullptr if no row has one
+     * @param size Number of rows
+     */
+    void view(const int64_t *data, size_t size) {
+        _blocks.clear();
+        _blocks.shrink_to_fit();
+        _size = 0;
+        _timestamped = false;
+        _view = nullptr;
+        if (data) {
+            _view = data;
+            _size = size;
+        } else {
+            pad(size);
+        }
+    }
+
+    /**
+     * Copy a view into owned storage
+     */
+    void materialize() {
+        if (_view) {
+            const int64_t *data = _view;
+            const size_t size = _size;
+            _view = nullptr;
+            _size = 0;
+            for (size_t i = 0; i < size; ++i) {
+                add(data[i]);
+            }
+        }
+    }
+
+    void push_back(int64_t timestamp) {
+        materialize();
+        add(timestamp);
+    }
+
+    /**
+     * Append timestamps, or rows without one if values is nullptr
+     */
+    void append(const int64_t *values, size_t count) {
+        materialize();
+        if (!values) {
+            pad(count);
+            return;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            add(values[i]);
+        }
+    }
+
+    int64_t operator[](size_t row) const {
+        if (_view) {
+            return _view[row];
+        }
+
+        const Block &block = _blocks[row >> BLOCK_BITS];
+        const size_t i = row & (BLOCK_SIZE - 1);
+        if (!block.full.empty()) {
+            return block.full[i];
+        }
+        if (block.offsets.empty() || NO_OFFSET == block.offsets[i]) {
+            return Stock::NO_TIMESTAMP;
+        }
+        return block.base + block.offsets[i];
+    }
+
+    /**
+     * All timestamps as one array
+     *
+     * @param buffer Filled with the timestamps unless the column is a view
+     * @return Timestamps, nullptr if no row has one
+     */
+    const int64_t *data(vector<int64_t> &buffer) const {
+        if (_view || !_timestamped) {
+            return _view;
+        }
+
+        buffer.resize(_size);
+        for (size_t i = 0; i < _size; ++i) {
+            buffer[i] = (*this)[i];
+        }
+        return buffer.data();
+    }
+
+    size_t size() const { return _size; }
+};
+
+const int32_t TimestampColumn::NO_OFFSET;
+
+/**
+ * Column oriented (struct of arrays) storage of validated transactions.
+ *
+ * Each transaction takes 17 bytes spread over four contiguous columns: type
+ * (1), quantity (4), price (8, Money) and symbol id (4) interned through
+ * SymbolTable::global(). Scans such as the summary only touch the columns they
+ * need and never chase pointers. Timestamps take another 4 bytes for most
+ * transactions and none for those recorded before the first timestamped one,
+ * which read as Stock::NO_TIMESTAMP (see TimestampColumn).
+ *
+ * The columns can also be served straight out of a mapped snapshot, in which
+ * case they are copied into memory only once the store is appended to.
+ */
+class TransactionStore {
+private:
+    Column<uint8_t> _types;
+    Column<uint32_t> _quantities;
+    Column<Money> _prices;
+    Column<uint32_t> _symbolIds;
+
+    // Same length as the other columns, holding no memory until the first
+    // timestamped transaction
+    TimestampColumn _timestamps;
+
+    // Mapping backing the column views, if any
+    shared_ptr<const MappedFile> _mapping;
+
+    void materialize() {
+        if (_mapping) {
+            _types.materialize();
+            _quantities.materialize();
+            _prices.materialize();
+            _symbolIds.materialize();
+            _timestamps.materialize();
+            _mapping.reset();
+        }
+    }
+
+public:
+    /**
+     * Append a transaction that already passed Stock validation
+     *
+     * @param type Stock::BUY or Stock::SELL
+     * @param quantity Number of shares
+     * @param symbolId Symbol id from SymbolTable::global()
+     * @param price Price per share
+     * @param timestamp Milliseconds since the epoch or Stock::NO_TIMESTAMP
+     */
+    void append(int type, uint32_t quantity, uint32_t symbolId, Money price,
+                int64_t timestamp = Stock::NO_TIMESTAMP) {
+        materialize();
+        _timestamps.push_back(timestamp);
+        _types.push_back((uint8_t)type);
+        _quantities.push_back(quantity);
+        _prices.push_back(price);
+        _symbolIds.push_back(symbolId);
+    }
+
+    /**
+     * Append a batch of validated transactions given as columns
+     *
+     * @param types Transaction types
+     * @param quantities Numbers of shares
+     * @param symbolIds Symbol ids from SymbolTable::global()
+     * @param prices Prices per share
+     * @param timestamps Timestamps, nullptr if the batch has none
+     * @param count Number of transactions
+     */
+    void append(const uint8_t *types, const uint32_t *quantities,
+                const uint32_t *symbolIds, const Money *prices,
+                const int64_t *timestamps, size_t count) {
+        materialize();
+        _timestamps.append(timestamps, count);
+        _types.append(types, count);
+        _quantities.append(quantities, count);
+        _symbolIds.append(symbolIds, count);
+        _prices.append(prices, count);
+    }
+
+    /**
+     * Serve an empty store from columns inside a mapped file
+     *
+     * @param mapping File holding the columns, kept mapped while in use
+     * @param types Type column
+     * @param quantities Quantity column
+     * @param prices Price column
+     * @param symbolIds Symbol id column
+     * @param timestamps Timestamp column, nullptr if there is none
+     * @param count Number of transactions
+     */
+    void view(const shared_ptr<const MappedFile> &mapping,
+              const uint8_t *types, const uint32_t *quantities,
+              const Money *prices, const uint32_t *symbolIds,
+              const int64_t *timestamps, size_t count) {
+        _mapping = mapping;
+        _types.view(types, count);
+        _quantities.view(quantities, count);
+        _prices.view(prices, count);
+        _symbolIds.view(symbolIds, count);
+        _timestamps.view(timestamps, count);
+    }
+
+    /**
+     * Replace the symbol id column, for views whose symbols were renumbered
+     *
+     * @param symbolIds One symbol id per transaction
+     */
+    void assignSymbolIds(vector<uint32_t> &&symbolIds) {
+        _symbolIds.assign(move(symbolIds));
+    }
+
+    /**
+     * Replace the price column, for views whose prices were converted
+     *
+     * @param prices One price per transaction
+     */
+    void assignPrices(vector<Money> &&prices) { _prices.assign(move(prices)); }
+
+    /**
+     * Reserve room for more transactions so bulk loads do not over allocate
+     *
+     * @param count Number of transactions about to be appended
+     */
+    void reserve(size_t count) {
+        materialize();
+        count += size();
+        _types.reserve(count);
+        _quantities.reserve(count);
+        _prices.reserve(count);
+        _symbolIds.reserve(count);
+    }
+
+    size_t size() const { return _types.size(); }
+
+    const uint8_t *types() const { return _types.data(); }
+
+    const uint32_t *quantities() const { return _quantities.data(); }
+
+    const Money *prices() const { return _prices.data(); }
+
+    const uint32_t *symbolIds() const { return _symbolIds.data(); }
+
+    /**
+     * @return Timestamp of a transaction, Stock::NO_TIMESTAMP if it has none
+     */
+    int64_t timestamp(size_t row) const { return _timestamps[row]; }
+
+    /**
+     * Timestamps of all transactions as one array, for writing them out
+     *
+     * @param buffer Filled with the timestamps unless they are served from a
+     * mapping
+     * @return Timestamps, nullptr if no transaction has a timestamp
+     */
+    const int64_t *timestamps(vector<int64_t> &buffer) const {
+        return _timestamps.data(buffer);
+    }
+};
+
+/**
+ * Point in a journal file: the records before offset in one generation of
+ * the file. A journal starts a new generation each time it is emptied.
+ */
+struct JournalPosition {
+    uint32_t generation = 0;
+    uint64_t offset = 0;
+};
+
+/**
+ * Versioned, checksummed binary snapshot of a TransactionStore.
+ *
+ * The file is a fixed header followed by the price, timestamp, quantity, symbol
+ * id and type columns, each 64 byte aligned, and the symbol strings. The
+ * timestamp column is empty when the store has no timestamps. Columns are laid
+ * out exactly as in memory so a mapped snapshot can be served without
+ * deserializing. Snapshots use the byte order of the machine that wrote them.
+ *
+ * Prices are Money ticks since version 3. Version 2 snapshots held them as
+ * doubles, which are still read and rounded to Money. Since version 4 the
+ * header also holds the journal position a compacted snapshot covers, older
+ * headers end before it and cover no journal.
+ */
+class Snapshot {
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t count;
+        uint64_t symbolCount;
+        uint64_t timestampCount;
+        uint64_t pricesOffset;
+        uint64_t timestampsOffset;
+        uint64_t quantitiesOffset;
+        uint64_t symbolIdsOffset;
+        uint64_t typesOffset;
+        uint64_t symbolsOffset;
+        uint64_t fileSize;
+        uint64_t payloadChecksum;
+        uint64_t journalGeneration;
+        uint64_t journalOffset;
+        uint64_t headerChecksum;
+    };
+
+    static const char MAGIC[8];
+    static const uint32_t VERSION = 4;
+    static const uint32_t JOURNAL_VERSION = 4;
+    static const uint32_t DOUBLE_PRICES_VERSION = 2;
+    static const uint32_t ENDIAN_MARKER = 0x01020304;
+
+    static uint64_t align(uint64_t offset) { return (offset + 63) & ~63ULL; }
+
+    static uint64_t headerChecksum(const Header &header) {
+        return checksum(&header, offsetof(Header, headerChecksum), 0);
+    }
+
+    static void fail(const string &msg) {
+        throw StockException(StockException::ERROR_INVALID_SNAPSHOT, msg);
+    }
+
+    /**
+     * Read and check the header of a snapshot. The header of an older
+     * version is returned with an empty journal position.
+     *
+     * @throws StockException if the header is corrupted
+     */
+    static Header readHeader(const char *data, size_t size) {
+        Header header;
+        if (size < sizeof(header) || !matches(data, size)) {
+            fail("Not a transactions snapshot");
+        }
+
+        memcpy(&header, data, sizeof(header));
+        if (header.version < DOUBLE_PRICES_VERSION ||
+            header.version > VERSION || header.byteOrder != ENDIAN_MARKER) {
+            fail("Unsupported snapshot version or byte order");
+        }
+
+        // Older headers hold their checksum where the journal position is
+        if (header.version < JOURNAL_VERSION) {
+            if (header.journalGeneration !=
+                checksum(&header, offsetof(Header, journalGeneration), 0)) {
+                fail("Header checksum mismatch");
+            }
+            header.journalGeneration = 0;
+            header.journalOffset = 0;
+        } else if (header.headerChecksum != headerChecksum(header)) {
+            fail("Header checksum mismatch");
+        }
+
+        return header;
+    }
+
+    static JournalPosition journalOf(const Header &header) {
+        JournalPosition journal;
+        journal.generation = (uint32_t)header.journalGeneration;
+        journal.offset = header.journalOffset;
+        return journal;
+    }
+
+public:
+    /**
+     * 64-bit checksum of a byte range, four independent multiply-xor lanes
+     * over 8 byte words so it runs near memory speed
+     */
+    static uint64_t checksum(const void *data, size_t size, uint64_t seed) {
+        const uint64_t PRIME = 0x9E3779B97F4A7C15ULL;
+        const char *ptr = static_cast<const char *>(data);
+        uint64_t lanes[4] = {seed, seed ^ 1, seed ^ 2, seed ^ 3};
+
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32) {
+            for (int lane = 0; lane < 4; ++lane) {
+                uint64_t word;
+                memcpy(&word, ptr + i + 8 * lane, sizeof(word));
+                lanes[lane] = (lanes[lane] ^ word) * PRIME;
+                lanes[lane] ^= lanes[lane] >> 29;
+            }
+        }
+
+        uint64_t result = size;
+        for (int lane = 0; lane < 4; ++lane) {
+            result = (result ^ lanes[lane]) * PRIME;
+        }
+        for (; i < size; ++i) {
+            result = (result ^ (unsigned char)ptr[i]) * PRIME;
+        }
+
+        return result ^ (result >> 32);
+    }
+
+    /**
+     * Columns of a validated snapshot, pointing into its mapping
+     */
+    struct View {
+        const uint8_t *types;
+        const uint32_t *quantities;
+        const Money *prices;
+        const uint32_t *symbolIds;
+
+        // Prices of an older snapshot converted to Money, prices points into
+        // it. Empty when prices points into the mapping.
+        vector<Money> convertedPrices;
+
+        // nullptr when the snapshot has no timestamps
+        const int64_t *timestamps;
+        size_t count;
+
+        // Snapshot symbol id to SymbolTable::global() id
+        vector<uint32_t> symbolMap;
+
+        // true when every symbol kept its id and symbolIds can be used as is
+        bool identity;
+
+        // Journal records already included
+        JournalPosition journal;
+    };
+
+    /**
+     * Check if a buffer starts like a snapshot
+     */
+    static bool matches(const char *data, size_t size) {
+        return size >= sizeof(MAGIC) && 0 == memcmp(data, MAGIC, sizeof(MAGIC));
+    }
+
+    /**
+     * Journal position covered by a snapshot, reading only its header
+     *
+     * @throws StockException if the header is corrupted
+     */
+    static JournalPosition journalPosition(const char *data, size_t size) {
+        return journalOf(readHeader(data, size));
+    }
+
+    /**
+     * Write a snapshot of the given columns. The snapshot is written to a
+     * temporary file that replaces fileName once complete, so an existing
+     * snapshot is never left half written.
+     *
+     * @param fileName Path of the snapshot
+     * @param store Transactions to save
+     * @param journal Journal records included in store, when compacting
+     * @throws StockException if the snapshot cannot be written
+     */
+    static void save(const string &fileName, const TransactionStore &store,
+                     const JournalPosition &journal = JournalPosition()) {
+        const SymbolTable &symbols = SymbolTable::global();
+        const uint64_t count = store.size();
+        vector<int64_t> timestampBuffer;
+        const int64_t *timestamps = store.timestamps(timestampBuffer);
+        const uint64_t timestampCount = timestamps ? count : 0;
+
+        // Symbols as 32-bit length followed by the characters
+        string symbolData;
+        const uint64_t symbolCount = symbols.size();
+        for (uint32_t id = 0; id < symbolCount; ++id) {
+            const string &sym = symbols.symbol(id);
+            const uint32_t length = (uint32_t)sym.size();
+            symbolData.append(reinterpret_cast<const char *>(&length),
+                              sizeof(length));
+            symbolData.append(sym);
+        }
+
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.byteOrder = ENDIAN_MARKER;
+        header.count = count;
+        header.symbolCount = symbolCount;
+        header.timestampCount = timestampCount;
+        header.pricesOffset = align(sizeof(Header));
+        header.timestampsOffset =
+            align(header.pricesOffset + count * sizeof(Money));
+        header.quantitiesOffset = align(header.timestampsOffset +
+                                        timestampCount * sizeof(int64_t));
+        header.symbolIdsOffset =
+            align(header.quantitiesOffset + count * sizeof(uint32_t));
+        header.typesOffset =
+            align(header.symbolIdsOffset + count * sizeof(uint32_t));
+        header.symbolsOffset = align(header.typesOffset + count);
+        header.fileSize = header.symbolsOffset + symbolData.size();
+        header.journalGeneration = journal.generation;
+        header.journalOffset = journal.offset;
+
+        const struct {
+            uint64_t offset;
+            const void *data;
+            size_t size;
+        } sections[] = {
+            {header.pricesOffset, store.prices(), count * sizeof(Money)},
+            {header.timestampsOffset, timestamps,
+             timestampCount * sizeof(int64_t)},
+            {header.quantitiesOffset, store.quantities(),
+             count * sizeof(uint32_t)},
+            {header.symbolIdsOffset, store.symbolIds(),
+             count * sizeof(uint32_t)},
+            {header.typesOffset, store.types(), count},
+            {header.symbolsOffset, symbolData.data(), symbolData.size()}};
+
+        for (const auto &section : sections) {
+            header.payloadChecksum =
+                checksum(section.data, section.size, header.payloadChecksum);
+        }
+        header.headerChecksum = headerChecksum(header);
+
+        const string tempName = fileName + ".tmp";
+        ofstream ofs(tempName, ios::binary | ios::trunc);
+        if (!ofs.is_open()) {
+            fail("Cannot create " + tempName);
+        }
+
+        static const char padding[64] = {};
+        ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        uint64_t offset = sizeof(header);
+        for (const auto &section : sections) {
+            ofs.write(padding, (streamsize)(section.offset - offset));
+            ofs.write(static_cast<const char *>(section.data),
+                      (streamsize)section.size);
+            offset = section.offset + section.size;
+        }
+        ofs.close();
+
+        // The snapshot must be on disk before it replaces the previous one
+        bool synced = false;
+        const int fd = ::open(tempName.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            synced = syncFile(fd);
+            ::close(fd);
+        }
+
+        if (!ofs || !synced || rename(tempName.c_str(), fileName.c_str())) {
+            remove(tempName.c_str());
+            fail("Cannot write " + fileName);
+        }
+
+        // The rename itself is only durable once the directory is synced
+        if (!syncDirectory(fileName)) {
+            fail("Cannot sync the directory of " + fileName);
+        }
+    }
+
+    /**
+     * Validate a mapped snapshot and locate its columns. Symbols are interned
+     * into SymbolTable::global().
+     *
+     * @param data Contents of the snapshot
+     * @param size Size of the contents in bytes
+     * @return Columns of the snapshot
+     * @throws StockException if the snapshot is truncated or corrupted
+     */
+    static View open(const char *data, size_t size) {
+        const Header header = readHeader(data, size);
+
+        const uint64_t count = header.count;
+        const uint64_t timestampCount = header.timestampCount;
+        if (header.fileSize != size || count > size ||
+            (timestampCount && timestampCount != count) ||
+            header.pricesOffset != align(sizeof(Header)) ||
+            header.timestampsOffset !=
+                align(header.pricesOffset + count * sizeof(Money)) ||
+            header.quantitiesOffset !=
+                align(header.timestampsOffset +
+                      timestampCount * sizeof(int64_t)) ||
+            header.symbolIdsOffset !=
+                align(header.quantitiesOffset + count * sizeof(uint32_t)) ||
+            header.typesOffset !=
+                align(header.symbolIdsOffset + count * sizeof(uint32_t)) ||
+            header.symbolsOffset != align(header.typesOffset + count) ||
+            header.symbolsOffset > size) {
+            fail("Truncated or inconsistent snapshot");
+        }
+
+        const struct {
+            uint64_t offset;
+            uint64_t size;
+        } sections[] = {
+            {header.pricesOffset, count * sizeof(Money)},
+            {header.timestampsOffset, timestampCount * sizeof(int64_t)},
+            {header.quantitiesOffset, count * sizeof(uint32_t)},
+            {header.symbolIdsOffset, count * sizeof(uint32_t)},
+            {header.typesOffset, count},
+            {header.symbolsOffset, size - header.symbolsOffset}};
+
+        uint64_t payloadChecksum = 0;
+        for (const auto &section : sections) {
+            payloadChecksum = checksum(data + section.offset,
+                                       (size_t)section.size, payloadChecksum);
+        }
+        if (payloadChecksum != header.payloadChecksum) {
+            fail("Payload checksum mismatch");
+        }
+
+        View view;
+        view.prices =
+            reinterpret_cast<const Money *>(data + header.pricesOffset);
+        if (DOUBLE_PRICES_VERSION == header.version) {
+            view.convertedPrices.resize((size_t)count);
+            for (size_t i = 0; i < count; ++i) {
+                double price;
+                memcpy(&price, data + header.pricesOffset + i * sizeof(price),
+                       sizeof(price));
+                if (!Money::fromDouble(price, view.convertedPrices[i])) {
+                    fail("Price out of range");
+                }
+            }
+            view.prices = view.convertedPrices.data();
+        }
+        view.timestamps =
+            timestampCount ? reinterpret_cast<const int64_t *>(
+                                 data + header.timestampsOffset)
+                           : nullptr;
+        view.quantities =
+            reinterpret_cast<const uint32_t *>(data + header.quantitiesOffset);
+        view.symbolIds =
+            reinterpret_cast<const uint32_t *>(data + header.symbolIdsOffset);
+        view.types =
+            reinterpret_cast<const uint8_t *>(data + header.typesOffset);
+        view.count = (size_t)count;
+        view.identity = true;
+        view.journal = journalOf(header);
+
+        const char *ptr = data + header.symbolsOffset, *end = data + size;
+        for (uint64_t id = 0; id < header.symbolCount; ++id) {
+            uint32_t length;
+            if ((size_t)(end - ptr) < sizeof(length)) {
+                fail("Truncated symbol table");
+            }
+            memcpy(&length, ptr, sizeof(length));
+            ptr += sizeof(length);
+            if ((size_t)(end - ptr) < length) {
+                fail("Truncated symbol table");
+            }
+
+            const uint32_t symbolId =
+                SymbolTable::global().intern(ptr, length);
+            view.symbolMap.push_back(symbolId);
+            view.identity = view.identity && symbolId == id;
+            ptr += length;
+        }
+
+        // A checksum only catches accidental damage, make sure the columns
+        // cannot index outside the symbol table either
+        uint32_t maxSymbolId = 0;
+        uint8_t badTypes = 0;
+        for (size_t i = 0; i < view.count; ++i) {
+            maxSymbolId = max(maxSymbolId, view.symbolIds[i]);
+            badTypes |= (uint8_t)(view.types[i] != Stock::BUY &&
+                                  view.types[i] != Stock::SELL);
+        }
+        if (view.count && (maxSymbolId >= header.symbolCount || badTypes)) {
+            fail("Invalid symbol id or transaction type");
+        }
+
+        return view;
+    }
+};
+
+const char Snapshot::MAGIC[8] = {'T', 'X', 'S', 'N', 'A', 'P', '\r', '\n'};
+
+/**
+ * Compact log of the rows rejected by a bulk load. Each row takes a single
+ * 64-bit word holding its line number and StockException error code, and the
+ * messages are only formatted when the log is reported.
+ */
+class LoadErrorLog {
+private:
+    vector<uint64_t> _entries;
+
+public:
+    /**
+     * @param line Line number of the rejected row
+     * @param code StockException error code, negative
+     */
+    void add(size_t line, int code) {
+        _entries.push_back((uint64_t)line << 8 | (uint8_t)-code);
+    }
+
+    size_t size() const { return _entries.size(); }
+
+    size_t line(size_t i) const { return (size_t)(_entries[i] >> 8); }
+
+    int code(size_t i) const { return -(int)(_entries[i] & 0xff); }
+
+    /**
+     * Write one line per rejected row with the message the row's
+     * StockException would have, line numbers offset by the given amount
+     *
+     * @param out Stream to write to
+     * @param lineOffset Added to the logged line numbers
+     */
+    void report(ostream &out, size_t lineOffset = 0) const {
+        for (size_t i = 0; i < size(); ++i) {
+            if (StockException::ERROR_MALFORMED_RECORD == code(i)) {
+                StockException::write(
+                    out, code(i),
+                    "Ignored line " + to_string(line(i) + lineOffset));
+            } else {
+                StockException::write(out, code(i), "Ignored");
+            }
+            out << '\n';
+        }
+    }
+};
+
+/**
+ * Transactions parsed from one newline aligned chunk of a transactions file.
+ *
+ * Chunks are parsed independently, possibly on different threads, into their
+ * own columns. Symbols are interned straight into the shared SymbolTable, and
+ * diagnostics keep chunk relative line numbers until the chunk's starting
+ * line is known.
+ */
+struct LoadChunk {
+    const char *data = nullptr;
+    size_t size = 0;
+
+    vector<uint8_t> types;
+    vector<uint32_t> quantities;
+    vector<Money> prices;
+    vector<uint32_t> symbolIds;
+
+    // Empty unless a record of the chunk has a timestamp
+    vector<int64_t> timestamps;
+    LoadErrorLog errors;
+
+    // Number of lines in the chunk
+    size_t lines = 0;
+
+#if STATS_ENABLED
+    // Time spent in parse()
+    uint64_t parseNanos = 0;
+#endif
+
+    LoadChunk(const char *chunkData, size_t chunkSize)
+        : data(chunkData), size(chunkSize) {}
+
+    /**
+     * Split a buffer into chunks of roughly the given size that end right
+     * after a newline, so that no record straddles two chunks
+     *
+     * @param data Contents of the transactions file
+     * @param size Size of the contents in bytes
+     * @param chunkSize Target chunk size in bytes
+     * @return Chunks in file order
+     */
+    static vector<unique_ptr<LoadChunk>> split(const char *data, size_t size,
+                                               size_t chunkSize) {
+        vector<unique_ptr<LoadChunk>> chunks;
+        const char *end = data + size;
+        while (data < end) {
+            const char *cut = end;
+            if ((size_t)(end - data) > chunkSize) {
+                cut = static_cast<const char *>(
+                    memchr(data + chunkSize, '\n',
+                           (size_t)(end - data) - chunkSize));
+                cut = cut ? cut + 1 : end;
+            }
+
+            chunks.emplace_back(new LoadChunk(data, (size_t)(cut - data)));
+            data = cut;
+        }
+
+        return chunks;
+    }
+
+    /**
+     * Parse and validate all records of the chunk
+     */
+    void parse() {
+#if STATS_ENABLED
+        const chrono::steady_clock::time_point start =
+            chrono::steady_clock::now();
+#endif
+        const size_t rows = RecordScanner::countLines(data, size) + 1;
+        types.reserve(rows);
+        quantities.reserve(rows);
+        prices.reserve(rows);
+        symbolIds.reserve(rows);
+
+        RecordScanner scanner(data, size);
+        RecordScanner::Record rec;
+        int status;
+        while ((status = scanner.next(rec)) != RecordScanner::END) {
+            if (RecordScanner::MALFORMED == status) {
+                errors.add(rec.line, StockException::ERROR_MALFORMED_RECORD);
+                continue;
+            }
+
+            if (Stock::BUY != rec.type && Stock::SELL != rec.type) {
+                continue;
+            }
+
+            // Rejected rows are logged without raising StockException
+            const int error = Stock::validate(rec.quantity, rec.symbol,
+                                              rec.symbolLength, rec.price);
+            if (error) {
+                errors.add(rec.line, error);
+                continue;
+            }
+
+            if (Stock::NO_TIMESTAMP != rec.timestamp || !timestamps.empty()) {
+                timestamps.resize(types.size(), Stock::NO_TIMESTAMP);
+                timestamps.push_back(rec.timestamp);
+            }
+            types.push_back((uint8_t)rec.type);
+            quantities.push_back((uint32_t)rec.quantity);
+            prices.push_back(rec.price);
+            symbolIds.push_back(
+                SymbolTable::global().intern(rec.symbol, rec.symbolLength));
+        }
+
+        lines = scanner.line() - 1;
+#if STATS_ENABLED
+        parseNanos = Stats::since(start);
+#endif
+    }
+
+#if STATS_ENABLED
+    /**
+     * Add the rows, bytes and parse time of the chunk to the statistics
+     */
+    void addTo(Stats &stats) const {
+        stats.histogram("parse-chunk").record(parseNanos);
+        stats.addParsed(size);
+        stats.addValid(types.size());
+        for (size_t i = 0; i < errors.size(); ++i) {
+            stats.addRejected(errors.code(i));
+        }
+    }
+#endif
+};
+
+/**
+ * Append-only binary journal of transactions with group commit.
+ *
+ * Records appended by any thread are buffered and written by a single
+ * committer thread, which waits at most the configured latency bound for more
+ * records to arrive before writing and syncing the whole batch at once.
+ * Appenders that need durability wait for their record's sequence number to
+ * be committed. A torn tail left by a crash is detected by the per-record
+ * checksum and cut off on replay.
+ *
+ * Emptying the journal once its records are compacted into a snapshot starts
+ * a new generation of the file. The snapshot names the generation and size it
+ * covers, so records compacted just before a crash are not replayed twice.
+ */
+class Journal {
+private:
+    // File header: magic followed by the 32-bit format version and the 32-bit
+    // generation, which older journals leave zero
+    static const char MAGIC[8];
+    static const uint32_t VERSION = 3;
+    static const size_t HEADER_SIZE = 16;
+
+    // Version whose records hold the price as a double, still replayed
+    static const uint32_t DOUBLE_PRICES_VERSION = 2;
+
+    // Record header: checksum (4), symbol length (2), type (1), reserved (1),
+    // quantity (4), price (8, Money ticks), timestamp (8), then the symbol
+    // characters
+    static const size_t RECORD_HEADER_SIZE = 28;
+
+    // Batches are written early once they reach this size
+    static const size_t BATCH_BYTES = 1 << 20;
+
+    int _fd = -1;
+    uint32_t _generation = 0;
+    chrono::microseconds _latency{0};
+
+    mutex _lock;
+    condition_variable _pending;
+    condition_variable _committed;
+    string _buffer;
+    chrono::steady_clock::time_point _oldest;
+    uint64_t _appended = 0;
+    uint64_t _durable = 0;
+    uint64_t _size = 0;
+    bool _stop = false;
+    bool _failed = false;
+    thread _committer;
+
+    static bool writeAll(int fd, const char *data, size_t size) {
+        while (size) {
+            const ssize_t written = write(fd, data, size);
+            if (written < 0) {
+                if (EINTR == errno) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= (size_t)written;
+        }
+        return true;
+    }
+
+    static bool writeHeader(int fd, uint32_t generation) {
+        char header[HEADER_SIZE] = {};
+        memcpy(header, MAGIC, sizeof(MAGIC));
+        const uint32_t version = VERSION;
+        memcpy(header + sizeof(MAGIC), &version, sizeof(version));
+        memcpy(header + sizeof(MAGIC) + sizeof(version), &generation,
+               sizeof(generation));
+        return writeAll(fd, header, sizeof(header)) && syncFile(fd);
+    }
+
+    void commitLoop() {
+        unique_lock<mutex> guard(_lock);
+        for (;;) {
+            _pending.wait(guard, [&]() { return _stop || !_buffer.empty(); });
+            if (_buffer.empty()) {
+                break;
+            }
+
+            // Give concurrent appenders until the latency bound to join
+            _pending.wait_until(guard, _oldest + _latency, [&]() {
+                return _stop || _buffer.size() >= BATCH_BYTES;
+            });
+
+            string batch;
+            batch.swap(_buffer);
+            const uint64_t sequence = _appended;
+            guard.unlock();
+
+            const bool ok = writeAll(_fd, batch.data(), batch.size()) &&
+                            syncFile(_fd);
+
+            guard.lock();
+            if (ok) {
+                _durable = sequence;
+            } else {
+                _failed = true;
+            }
+            _committed.notify_all();
+        }
+    }
+
+public:
+    Journal() = default;
+    Journal(const Journal &) = delete;
+    Journal &operator=(const Journal &) = delete;
+
+    ~Journal() { close(); }
+
+    /**
+     * Read all complete records of a journal past those a snapshot covers. A
+     * truncated or corrupted record ends the replay, as that is where the
+     * last session stopped. Prices of older journals are rounded to Money.
+     *
+     * @param fileName Path of the journal
+     * @param covered Position up to which records are skipped, when the
+     * journal is still of the same generation
+     * @param apply Called with type, quantity, symbol, price and timestamp of
+     * each record
+     * @param current Set to false if the journal has an older format, which
+     * must be compacted before it is appended to
+     * @return Generation of the journal and size in bytes of its valid
+     * prefix, 0 if the file is missing
+     * @throws StockException if the file is not a journal
+     */
+    template <typename Apply>
+    static JournalPosition replay(const string &fileName,
+                                  const JournalPosition &covered, Apply apply,
+                                  bool *current = nullptr) {
+        JournalPosition valid;
+        MappedFile file;
+        if (!file.open(fileName) || !file.size()) {
+            return valid;
+        }
+
+        const char *data = file.data();
+        const size_t size = file.size();
+        uint32_t version = 0;
+        if (size >= HEADER_SIZE) {
+            memcpy(&version, data + sizeof(MAGIC), sizeof(version));
+            memcpy(&valid.generation, data + sizeof(MAGIC) + sizeof(version),
+                   sizeof(valid.generation));
+        }
+        if (size < HEADER_SIZE || memcmp(data, MAGIC, sizeof(MAGIC)) ||
+            (VERSION != version && DOUBLE_PRICES_VERSION != version)) {
+            throw StockException(StockException::ERROR_JOURNAL_FAILURE,
+                                 "Not a transactions journal: " + fileName);
+        }
+        if (current) {
+            *current = VERSION == version;
+        }
+
+        const size_t skipped =
+            covered.generation == valid.generation ? covered.offset : 0;
+        size_t offset = HEADER_SIZE;
+        while (size - offset >= RECORD_HEADER_SIZE) {
+            const char *rec = data + offset;
+            uint32_t checksum, quantity;
+            uint16_t length;
+            int64_t ticks, timestamp;
+            memcpy(&checksum, rec, sizeof(checksum));
+            memcpy(&length, rec + 4, sizeof(length));
+            memcpy(&quantity, rec + 8, sizeof(quantity));
+            memcpy(&ticks, rec + 12, sizeof(ticks));
+            memcpy(&timestamp, rec + 20, sizeof(timestamp));
+
+            const size_t recordSize = RECORD_HEADER_SIZE + length;
+            if (size - offset < recordSize ||
+                checksum != (uint32_t)Snapshot::checksum(rec + 4,
+                                                         recordSize - 4, 0)) {
+                break;
+            }
+
+            Money price = Money::fromTicks(ticks);
+            if (DOUBLE_PRICES_VERSION == version) {
+                double value;
+                memcpy(&value, rec + 12, sizeof(value));
+                if (!Money::fromDouble(value, price)) {
+                    break;
+                }
+            }
+
+            if (offset >= skipped) {
+                apply((int)(uint8_t)rec[6], quantity,
+                      string(rec + RECORD_HEADER_SIZE, length), price,
+                      timestamp);
+            }
+            offset += recordSize;
+        }
+
+        valid.offset = offset;
+        return valid;
+    }
+
+    /**
+     * Open a journal for appending, creating it if needed, and start the
+     * committer. Anything past the valid prefix, such as a torn record, is
+     * cut off.
+     *
+     * @param fileName Path of the journal
+     * @param valid Position returned by replay(), a journal that is missing
+     * or empty is created with its generation
+     * @param latency Longest time a record waits for its batch to be written
+     * @return true on success
+     */
+    bool open(const string &fileName, const JournalPosition &valid,
+              chrono::microseconds latency) {
+        close();
+
+        _fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (_fd < 0) {
+            return false;
+        }
+
+        uint64_t validSize = valid.offset;
+        bool ok = 0 == ftruncate(_fd, (off_t)validSize);
+        if (ok && !validSize) {
+            ok = writeHeader(_fd, valid.generation);
+            validSize = HEADER_SIZE;
+        }
+
+        if (!ok) {
+            ::close(_fd);
+            _fd = -1;
+            return false;
+        }
+
+        _generation = valid.generation;
+        _latency = latency;
+        _size = validSize;
+        _stop = false;
+        _failed = false;
+        _committer = thread(&Journal::commitLoop, this);
+        return true;
+    }
+
+    /**
+     * Commit buffered records, stop the committer and close the file
+     */
+    void close() {
+        if (_fd < 0) {
+            return;
+        }
+
+        {
+            lock_guard<mutex> guard(_lock);
+            _stop = true;
+            _pending.notify_all();
+        }
+        _committer.join();
+
+        ::close(_fd);
+        _fd = -1;
+    }
+
+    bool isOpen() const { return _fd >= 0; }
+
+    /**
+     * Buffer a transaction for the next batch, safe to call from any thread
+     *
+     * @param symbol Symbol validated by Stock::validate(), so that its length
+     * fits in the record
+     * @return Sequence number to pass to waitDurable()
+     */
+    uint64_t append(int type, uint32_t quantity, const string &symbol,
+                    Money price, int64_t timestamp) {
+        const uint16_t length = (uint16_t)symbol.size();
+        const int64_t ticks = price.ticks();
+        char rec[RECORD_HEADER_SIZE] = {};
+        memcpy(rec + 4, &length, sizeof(length));
+        rec[6] = (char)type;
+        memcpy(rec + 8, &quantity, sizeof(quantity));
+        memcpy(rec + 12, &ticks, sizeof(ticks));
+        memcpy(rec + 20, &timestamp, sizeof(timestamp));
+
+        string body(rec + 4, RECORD_HEADER_SIZE - 4);
+        body.append(symbol);
+        const uint32_t checksum =
+            (uint32_t)Snapshot::checksum(body.data(), body.size(), 0);
+
+        lock_guard<mutex> guard(_lock);
+        if (_buffer.empty()) {
+            _oldest = chrono::steady_clock::now();
+            _pending.notify_one();
+        }
+        _buffer.append(reinterpret_cast<const char *>(&checksum),
+                       sizeof(checksum));
+        _buffer.append(body);
+        _size += sizeof(checksum) + body.size();
+        if (_buffer.size() >= BATCH_BYTES) {
+            _pending.notify_one();
+        }
+
+        return ++_appended;
+    }
+
+    /**
+     * Wait until a record is on stable storage
+     *
+     * @param sequence Sequence number returned by append()
+     * @return false if the journal could not be written
+     */
+    bool waitDurable(uint64_t sequence) {
+        unique_lock<mutex> guard(_lock);
+        _committed.wait(guard,
+                        [&]() { return _failed || _durable >= sequence; });
+        return _durable >= sequence;
+    }
+
+    /**
+     * Size of the journal in bytes including buffered records
+     */
+    uint64_t size() {
+        lock_guard<mutex> guard(_lock);
+        return _size;
+    }
+
+    /**
+     * Drop all records once they have been compacted into a snapshot and
+     * start the next generation. The header is rewritten, which upgrades a
+     * journal of an older format.
+     *
+     * @param compacted Journal position covered by the snapshot, nothing is
+     * dropped if records were appended since
+     * @return true if the journal was truncated
+     */
+    bool truncate(const JournalPosition &compacted) {
+        unique_lock<mutex> guard(_lock);
+        _committed.wait(guard,
+                        [&]() { return _failed || _durable == _appended; });
+        if (_failed || _generation != compacted.generation ||
+            _size != compacted.offset) {
+            return false;
+        }
+
+        if (ftruncate(_fd, 0) || !writeHeader(_fd, _generation + 1)) {
+            _failed = true;
+            return false;
+        }
+
+        ++_generation;
+        _size = HEADER_SIZE;
+        return true;
+    }
+};
+
+const char Journal::MAGIC[8] = {'T', 'X', 'J', 'R', 'N', 'L', '\r', '\n'};
+
+/**
+ * Buy and sell counts and notionals of a set of transactions
+ */
+struct SummaryTotals {
+    size_t buyCount = 0;
+    size_t sellCount = 0;
+    Money buyTotal;
+    Money sellTotal;
+
+    // Set when a notional or total did not fit in Money, the totals are then
+    // incomplete
+    bool overflow = false;
+
+    /**
+     * Add one transaction with overflow checks
+     */
+    void add(int type, uint32_t quantity, Money price) {
+        const bool isBuy = Stock::BUY == type;
+        Money notional;
+        overflow |= !Money::multiply(price, quantity, notional) ||
+                    !(isBuy ? buyTotal : sellTotal).add(notional);
+        buyCount += isBuy;
+        sellCount += !isBuy;
+    }
+
+    /**
+     * Add the totals of another set of transactions
+     */
+    void add(const SummaryTotals &other) {
+        overflow |= other.overflow || !buyTotal.add(other.buyTotal) ||
+                    !sellTotal.add(other.sellTotal);
+        buyCount += other.buyCount;
+        sellCount += other.sellCount;
+    }
+};
+
+/**
+ * Kernels computing SummaryTotals over the transaction columns with exact
+ * integer arithmetic, with AVX2 and SSE2 variants selected at runtime on x86
+ * and a portable scalar variant everywhere else.
+ *
+ * Rows are summed in blocks of BLOCK rows with plain 32x32 to 64-bit
+ * multiplies and wrapping adds that vectorize, while the bits set in any price
+ * and quantity are collected in the same pass. When the prices of a block fit
+ * in 32 bits and the widest price times the widest quantity times BLOCK fits
+ * in 63 bits, no notional or block sum can have overflowed and the block sums
+ * are kept. Otherwise the block is summed again through SummaryTotals::add(),
+ * which checks every operation. Block sums are added to the totals with
+ * overflow checks. Integer sums do not depend on the order of the additions,
+ * so every variant returns the same totals.
+ */
+class SummaryKernel {
+public:
+    // Instruction set used by run()
+    static const int ISA_AUTO = 0;
+    static const int ISA_SCALAR = 1;
+    static const int ISA_SSE2 = 2;
+    static const int ISA_AVX2 = 3;
+
+private:
+    static const size_t BLOCK = 1024;
+    static const int BLOCK_BITS = 10;
+
+    // Unchecked sums of a block and the bits set in its prices and quantities
+    struct BlockSums {
+        uint64_t buy = 0;
+        uint64_t sell = 0;
+        uint64_t buyCount = 0;
+        uint64_t sellCount = 0;
+        uint64_t priceBits = 0;
+        uint64_t quantityBits = 0;
+
+        static int bitWidth(uint64_t value) {
+            return value ? 64 - __builtin_clzll(value) : 0;
+        }
+
+        /**
+         * Check if the sums are exact. Negative prices set the top bit and
+         * fail the 32-bit test.
+         */
+        bool exact() const {
+            return priceBits <= UINT32_MAX &&
+                   bitWidth(priceBits) + bitWidth(quantityBits) +
+                           BLOCK_BITS <=
+                       63;
+        }
+    };
+
+    /**
+     * Portable kernel, also used for the rows left over by the vector kernels
+     */
+    static void scalar(const uint8_t *types, const uint32_t *quantities,
+                       const Money *prices, size_t begin, size_t end,
+                       BlockSums &sums) {
+        for (size_t i = begin; i < end; ++i) {
+            const uint64_t price = (uint64_t)prices[i].ticks();
+            const uint64_t notional = (price & UINT32_MAX) * quantities[i];
+            const bool isBuy = Stock::BUY == types[i];
+            const bool isSell = Stock::SELL == types[i];
+
+            sums.buy += isBuy ? notional : 0;
+            sums.sell += isSell ? notional : 0;
+            sums.buyCount += isBuy;
+            sums.sellCount += isSell;
+            sums.priceBits |= price;
+            sums.quantityBits |= quantities[i];
+        }
+    }
+
+#if defined(__x86_64__)
+    /**
+     * SSE2 kernel, rows 0-1 and 2-3 of each group of four in separate
+     * registers
+     */
+    static void sse2(const uint8_t *types, const uint32_t *quantities,
+                     const Money *prices, size_t count, BlockSums &sums) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i buyType = _mm_set1_epi32(Stock::BUY);
+        const __m128i sellType = _mm_set1_epi32(Stock::SELL);
+        __m128i buy = zero, sell = zero, buyCount = zero, sellCount = zero,
+                priceBits = zero, quantityBits = zero;
+
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            int32_t packed;
+            memcpy(&packed, types + i, sizeof(packed));
+            const __m128i type32 = _mm_unpacklo_epi16(
+                _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+            const __m128i isBuy = _mm_cmpeq_epi32(type32, buyType);
+            const __m128i isSell = _mm_cmpeq_epi32(type32, sellType);
+
+            // _mm_mul_epu32 multiplies the low 32 bits of each 64-bit lane
+            const __m128i qty =
+                _mm_loadu_si128((const __m128i *)(quantities + i));
+            const __m128i price[2] = {
+                _mm_loadu_si128((const __m128i *)(prices + i)),
+                _mm_loadu_si128((const __m128i *)(prices + i + 2))};
+            const __m128i notional[2] = {
+                _mm_mul_epu32(price[0], _mm_unpacklo_epi32(qty, zero)),
+                _mm_mul_epu32(price[1], _mm_unpackhi_epi32(qty, zero))};
+            priceBits = _mm_or_si128(priceBits,
+                                     _mm_or_si128(price[0], price[1]));
+            quantityBits = _mm_or_si128(quantityBits, qty);
+            const __m128i buyMask[2] = {_mm_unpacklo_epi32(isBuy, isBuy),
+                                        _mm_unpackhi_epi32(isBuy, isBuy)};
+            const __m128i sellMask[2] = {_mm_unpacklo_epi32(isSell, isSell),
+                                         _mm_unpackhi_epi32(isSell, isSell)};
+
+            for (int j = 0; j < 2; ++j) {
+                buy = _mm_add_epi64(buy,
+                                    _mm_and_si128(notional[j], buyMask[j]));
+                sell = _mm_add_epi64(sell,
+                                     _mm_and_si128(notional[j], sellMask[j]));
+                // Masks are all ones (-1) for matching rows
+                buyCount = _mm_sub_epi64(buyCount, buyMask[j]);
+                sellCount = _mm_sub_epi64(sellCount, sellMask[j]);
+            }
+        }
+
+        uint64_t lanes[6][2];
+        _mm_storeu_si128((__m128i *)lanes[0], buy);
+        _mm_storeu_si128((__m128i *)lanes[1], sell);
+        _mm_storeu_si128((__m128i *)lanes[2], buyCount);
+        _mm_storeu_si128((__m128i *)lanes[3], sellCount);
+        _mm_storeu_si128((__m128i *)lanes[4], priceBits);
+        _mm_storeu_si128((__m128i *)lanes[5], quantityBits);
+        sums.buy += lanes[0][0] + lanes[0][1];
+        sums.sell += lanes[1][0] + lanes[1][1];
+        sums.buyCount += lanes[2][0] + lanes[2][1];
+        sums.sellCount += lanes[3][0] + lanes[3][1];
+        sums.priceBits |= lanes[4][0] | lanes[4][1];
+        // Quantities are 32-bit, four to a register
+        sums.quantityBits |= (lanes[5][0] | lanes[5][1]) |
+                             ((lanes[5][0] | lanes[5][1]) >> 32);
+
+        scalar(types, quantities, prices, i, count, sums);
+    }
+
+    /**
+     * AVX2 kernel, four rows per register
+     */
+    __attribute__((target("avx2"))) static void
+    avx2(const uint8_t *types, const uint32_t *quantities, const Money *prices,
+         size_t count, BlockSums &sums) {
+        const __m256i buyType = _mm256_set1_epi64x(Stock::BUY);
+        const __m256i sellType = _mm256_set1_epi64x(Stock::SELL);
+        __m256i buy = _mm256_setzero_si256(), sell = buy, buyCount = buy,
+                sellCount = buy, priceBits = buy, quantityBits = buy;
+
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            int32_t packed;
+            memcpy(&packed, types + i, sizeof(packed));
+            const __m256i type64 =
+                _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed));
+            const __m256i isBuy = _mm256_cmpeq_epi64(type64, buyType);
+            const __m256i isSell = _mm256_cmpeq_epi64(type64, sellType);
+
+            const __m256i price =
+                _mm256_loadu_si256((const __m256i *)(prices + i));
+            const __m256i qty = _mm256_cvtepu32_epi64(
+                _mm_loadu_si128((const __m128i *)(quantities + i)));
+            const __m256i notional = _mm256_mul_epu32(price, qty);
+            priceBits = _mm256_or_si256(priceBits, price);
+            quantityBits = _mm256_or_si256(quantityBits, qty);
+
+            buy = _mm256_add_epi64(buy, _mm256_and_si256(notional, isBuy));
+            sell = _mm256_add_epi64(sell, _mm256_and_si256(notional, isSell));
+            // Masks are all ones (-1) for matching rows
+            buyCount = _mm256_sub_epi64(buyCount, isBuy);
+            sellCount = _mm256_sub_epi64(sellCount, isSell);
+        }
+
+        uint64_t lanes[6][4];
+        _mm256_storeu_si256((__m256i *)lanes[0], buy);
+        _mm256_storeu_si256((__m256i *)lanes[1], sell);
+        _mm256_storeu_si256((__m256i *)lanes[2], buyCount);
+        _mm256_storeu_si256((__m256i *)lanes[3], sellCount);
+        _mm256_storeu_si256((__m256i *)lanes[4], priceBits);
+        _mm256_storeu_si256((__m256i *)lanes[5], quantityBits);
+        for (int lane = 0; lane < 4; ++lane) {
+            sums.buy += lanes[0][lane];
+            sums.sell += lanes[1][lane];
+            sums.buyCount += lanes[2][lane];
+            sums.sellCount += lanes[3][lane];
+            sums.priceBits |= lanes[4][lane];
+            sums.quantityBits |= lanes[5][lane];
+        }
+
+        scalar(types, quantities, prices, i, count, sums);
+    }
+#endif
+
+public:
+    /**
+     * Best instruction set supported by the running CPU
+     */
+    static int detect() {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        // SSE2 is part of the x86-64 baseline
+        return __builtin_cpu_supports("avx2") ? ISA_AVX2 : ISA_SSE2;
+#else
+        return ISA_SCALAR;
+#endif
+    }
+
+    /**
+     * Name of an instruction set, as reported by benchmarks
+     */
+    static const char *name(int isa) {
+        return ISA_AVX2 == isa ? "avx2" : ISA_SSE2 == isa ? "sse2" : "scalar";
+    }
+
+    /**
+     * Summary of rows fed in consecutive batches of any size, the same as
+     * run() over all the rows at once
+     */
+    class Accumulator {
+    private:
+        SummaryTotals _totals;
+        int _isa;
+
+    public:
+        /**
+         * @param isa Instruction set to use, ISA_AUTO picks the best supported
+         */
+        explicit Accumulator(int isa = ISA_AUTO) : _isa(isa) {
+            static const int best = detect();
+            if (ISA_AUTO == _isa || _isa > best) {
+                _isa = best;
+            }
+        }
+
+        /**
+         * Add the next batch of rows
+         *
+         * @param types Transaction type column
+         * @param quantities Quantity column
+         * @param prices Price column
+         * @param count Number of rows
+         */
+        void add(const uint8_t *types, const uint32_t *quantities,
+                 const Money *prices, size_t count) {
+            for (size_t begin = 0; begin < count; begin += BLOCK) {
+                const size_t rows = min((size_t)BLOCK, count - begin);
+                const uint8_t *blockTypes = types + begin;
+                const uint32_t *blockQuantities = quantities + begin;
+                const Money *blockPrices = prices + begin;
+
+                BlockSums sums;
+#if defined(__x86_64__)
+                if (ISA_AVX2 == _isa) {
+                    avx2(blockTypes, blockQuantities, blockPrices, rows, sums);
+                } else if (ISA_SSE2 == _isa) {
+                    sse2(blockTypes, blockQuantities, blockPrices, rows, sums);
+                } else
+#endif
+                {
+                    scalar(blockTypes, blockQuantities, blockPrices, 0, rows,
+                           sums);
+                }
+
+                if (!sums.exact()) {
+                    for (size_t i = 0; i < rows; ++i) {
+                        _totals.add(blockTypes[i], blockQuantities[i],
+                                    blockPrices[i]);
+                    }
+                    continue;
+                }
+
+                _totals.overflow |=
+                    !_totals.buyTotal.add(
+                        Money::fromTicks((int64_t)sums.buy)) ||
+                    !_totals.sellTotal.add(
+                        Money::fromTicks((int64_t)sums.sell));
+                _totals.buyCount += sums.buyCount;
+                _totals.sellCount += sums.sellCount;
+            }
+        }
+
+        /**
+         * Totals of all rows added so far
+         */
+        const SummaryTotals &totals() const { return _totals; }
+    };
+
+    /**
+     * Compute the summary of the given transaction columns
+     *
+     * @param types Transaction type column
+     * @param quantities Quantity column
+     * @param prices Price column
+     * @param count Number of rows
+     * @param isa Instruction set to use, ISA_AUTO picks the best supported
+     * @return Counts and notionals per side
+     */
+    static SummaryTotals run(const uint8_t *types, const uint32_t *quantities,
+                             const Money *prices, size_t count,
+                             int isa = ISA_AUTO) {
+        Accumulator accumulator(isa);
+        accumulator.add(types, quantities, prices, count);
+        return accumulator.totals();
+    }
+};
+
+/**
+ * Running summary totals of a TransactionStore, overall and per symbol. Rows
+ * appended to the store are added when the book is next updated, the overall
+ * totals through SummaryKernel, so reading the totals only costs the rows
+ * appended since the last read.
+ */
+class SummaryBook {
+private:
+    const TransactionStore &_store;
+    SummaryTotals _totals;
+
+    // Indexed by symbol id
+    vector<SummaryTotals> _bySymbol;
+
+    // Rows added so far
+    size_t _rows = 0;
+
+public:
+    explicit SummaryBook(const TransactionStore &store) : _store(store) {}
+
+    /**
+     * Add the rows appended to the store since the last update
+     */
+    void update() {
+        const size_t size = _store.size();
+        if (_rows == size) {
+            return;
+        }
+
+        const uint8_t *types = _store.types();
+        const uint32_t *quantities = _store.quantities();
+        const Money *prices = _store.prices();
+        const uint32_t *symbolIds = _store.symbolIds();
+
+        _totals.add(SummaryKernel::run(types + _rows, quantities + _rows,
+                                       prices + _rows, size - _rows));
+        for (size_t row = _rows; row < size; ++row) {
+            if (symbolIds[row] >= _bySymbol.size()) {
+                _bySymbol.resize(symbolIds[row] + 1);
+            }
+            _bySymbol[symbolIds[row]].add(types[row], quantities[row],
+                                          prices[row]);
+        }
+        _rows = size;
+    }
+
+    /**
+     * Totals of all transactions
+     */
+    const SummaryTotals &totals() {
+        update();
+        return _totals;
+    }
+
+    /**
+     * Totals of each symbol, indexed by symbol id
+     */
+    const vector<SummaryTotals> &bySymbol() {
+        update();
+        return _bySymbol;
+    }
+};
+
+/**
+ * Pool of objects of one type carved out of large blocks. Creating an object
+ * bumps a pointer through the current block or reuses a released object, and
+ * the blocks are all freed together when the pool is destroyed, so objects
+ * are never allocated or destructed one by one. Objects must be trivially
+ * destructible.
+ */
+template <typename T> class ObjectPool {
+private:
+    static_assert(is_trivially_destructible<T>::value,
+                  "pooled objects are never destructed");
+
+    // Released objects are chained through their own storage
+    struct FreeNode {
+        FreeNode *next;
+    };
+
+    static const size_t ALIGN = alignof(T) > alignof(FreeNode)
+                                    ? alignof(T)
+                                    : alignof(FreeNode);
+    static const size_t SLOT_SIZE =
+        ((sizeof(T) > sizeof(FreeNode) ? sizeof(T) : sizeof(FreeNode)) +
+         ALIGN - 1) /
+        ALIGN * ALIGN;
+    static const size_t BLOCK_SIZE = 64 << 10;
+
+    static_assert(ALIGN <= alignof(max_align_t),
+                  "blocks are only aligned for fundamental types");
+
+    vector<unique_ptr<char[]>> _blocks;
+    char *_next = nullptr;
+    char *_end = nullptr;
+    FreeNode *_free = nullptr;
+
+public:
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+    ObjectPool(ObjectPool &&) = default;
+    ObjectPool &operator=(ObjectPool &&) = default;
+
+    /**
+     * Construct an object from the given aggregate initializers
+     */
+    template <typename... Args> T *create(Args &&...args) {
+        void *memory;
+        if (_free) {
+            memory = _free;
+            _free = _free->next;
+        } else {
+            if (_next == _end) {
+                _blocks.emplace_back(new char[BLOCK_SIZE]);
+                _next = _blocks.back().get();
+                _end = _next + BLOCK_SIZE / SLOT_SIZE * SLOT_SIZE;
+            }
+            memory = _next;
+            _next += SLOT_SIZE;
+        }
+
+        return new (memory) T{forward<Args>(args)...};
+    }
+
+    /**
+     * Return an object for reuse by a later create()
+     */
+    void release(T *object) {
+        FreeNode *node = new (object) FreeNode;
+        node->next = _free;
+        _free = node;
+    }
+
+    /**
+     * Number of blocks allocated
+     */
+    size_t blocks() const { return _blocks.size(); }
+};
+
+/**
+ * Running position, cost and realized profit & loss of one symbol
+ */
+struct SymbolPosition {
+    // Open FIFO lot, quantity is negative for short lots
+    struct Lot {
+        long long quantity;
+        double price;
+        Lot *next;
+    };
+
+    // Net shares held, negative when short
+    long long position = 0;
+
+    // Average cost per share of the open position (average cost method)
+    double averageCost = 0.0;
+
+    // Realized P&L under the FIFO and average cost methods
+    double realizedFifo = 0.0;
+    double realizedAverage = 0.0;
+
+    // Traded volume in shares
+    uint64_t boughtShares = 0;
+    uint64_t soldShares = 0;
+
+    // Open lots, oldest first, all on the same side as position. Lots are
+    // owned by the PositionBook's pool.
+    Lot *firstLot = nullptr;
+    Lot *lastLot = nullptr;
+};
+
+/**
+ * Per-symbol position and P&L aggregation, indexed by interned symbol id.
+ *
+ * Every trade is applied incrementally in amortized O(1): FIFO matching pops
+ * each open lot at most once, and the average cost method only keeps the
+ * running average. Queries read the aggregate and never rescan history.
+ *
+ * Open lots of all symbols come from one ObjectPool, so the positions are
+ * plain values that grow by memcpy, and tearing the book down frees a few
+ * large blocks rather than every lot.
+ */
+class PositionBook {
+private:
+    vector<SymbolPosition> _positions;
+    ObjectPool<SymbolPosition::Lot> _lots;
+
+    static long long sign(long long value) { return value < 0 ? -1 : 1; }
+
+    /**
+     * Apply a signed trade to the FIFO lots of a symbol
+     */
+    void applyFifo(SymbolPosition &pos, long long quantity, double price) {
+        while (quantity && pos.firstLot &&
+               sign(pos.firstLot->quantity) != sign(quantity)) {
+            SymbolPosition::Lot &lot = *pos.firstLot;
+            const long long matched = min(llabs(quantity), llabs(lot.quantity));
+
+            // Closing a long lot gains when selling higher, closing a short
+            // lot gains when buying lower
+            pos.realizedFifo += (double)(matched * sign(lot.quantity)) *
+                                (price - lot.price);
+
+            lot.quantity -= matched * sign(lot.quantity);
+            quantity -= matched * sign(quantity);
+            if (!lot.quantity) {
+                pos.firstLot = lot.next;
+                _lots.release(&lot);
+            }
+        }
+
+        if (quantity) {
+            SymbolPosition::Lot *lot = _lots.create(quantity, price, nullptr);
+            if (pos.firstLot) {
+                pos.lastLot->next = lot;
+            } else {
+                pos.firstLot = lot;
+            }
+            pos.lastLot = lot;
+        }
+    }
+
+    /**
+     * Apply a signed trade to the running average cost of a symbol
+     */
+    static void applyAverage(SymbolPosition &pos, long long quantity,
+                             double price) {
+        if (!pos.position || sign(pos.position) == sign(quantity)) {
+            const double held = (double)llabs(pos.position);
+            pos.averageCost =
+                (pos.averageCost * held + price * (double)llabs(quantity)) /
+                (held + (double)llabs(quantity));
+            pos.position += quantity;
+            return;
+        }
+
+        const long long matched = min(llabs(quantity), llabs(pos.position));
+        pos.realizedAverage += (double)(matched * sign(pos.position)) *
+                               (price - pos.averageCost);
+        pos.position += quantity;
+
+        if (!pos.position) {
+            pos.averageCost = 0.0;
+        } else if (sign(pos.position) == sign(quantity)) {
+            // Crossed through flat, the remainder opens at the trade price
+            pos.averageCost = price;
+        }
+    }
+
+public:
+    /**
+     * Apply a trade to the position of its symbol
+     *
+     * @param type Stock::BUY or Stock::SELL
+     * @param quantity Number of shares
+     * @param symbolId Interned symbol id
+     * @param price Price per share
+     */
+    void update(int type, uint32_t quantity, uint32_t symbolId, double price) {
+        if (symbolId >= _positions.size()) {
+            _positions.resize(symbolId + 1);
+        }
+
+        SymbolPosition &pos = _positions[symbolId];
+        if (!quantity) {
+            return;
+        }
+
+        long long signedQuantity = quantity;
+        if (Stock::BUY == type) {
+            pos.boughtShares += quantity;
+        } else {
+            pos.soldShares += quantity;
+            signedQuantity = -signedQuantity;
+        }
+
+        applyFifo(pos, signedQuantity, price);
+        applyAverage(pos, signedQuantity, price);
+    }
+
+    /**
+     * Get the aggregate of a symbol
+     *
+     * @param symbolId Interned symbol id
+     * @return Position of the symbol, null if it was never traded
+     */
+    const SymbolPosition *find(uint32_t symbolId) const {
+        return symbolId < _positions.size() ? &_positions[symbolId] : nullptr;
+    }
+};
+
+/**
+ * Open, high, low and close prices, volume and notional of the trades of one
+ * symbol within a fixed time interval
+ */
+struct OhlcBar {
+    // Start of the interval in milliseconds since the epoch
+    int64_t start = Stock::NO_TIMESTAMP;
+    double open = 0.0;
+    double high = 0.0;
+    double low = 0.0;
+    double close = 0.0;
+    double notional = 0.0;
+    uint64_t volume = 0;
+
+    /**
+     * Start a bar with its first trade
+     */
+    void begin(int64_t barStart, uint32_t quantity, double price) {
+        start = barStart;
+        open = high = low = close = price;
+        notional = price * quantity;
+        volume = quantity;
+    }
+
+    void add(uint32_t quantity, double price) {
+        high = max(high, price);
+        low = min(low, price);
+        close = price;
+        notional += price * quantity;
+        volume += quantity;
+    }
+
+    double vwap() const { return volume ? notional / (double)volume : 0.0; }
+};
+
+/**
+ * Aggregates over the trades of the trailing time window of one symbol.
+ *
+ * Adding a trade evicts the trades that fell out of the window. Volume and
+ * notional are running sums and the high and low are the fronts of monotonic
+ * queues, so each trade is pushed and popped at most once per queue: O(1)
+ * amortized per trade whatever the window length. Trades must be added in
+ * time order.
+ */
+class SlidingWindow {
+private:
+    struct Entry {
+        uint64_t sequence;
+        int64_t timestamp;
+        uint32_t quantity;
+        double price;
+    };
+
+    int64_t _length;
+    uint64_t _sequence = 0;
+    deque<Entry> _entries;
+
+    // Decreasing and increasing prices of the trades that can still become
+    // the window's high or low
+    deque<Entry> _highs;
+    deque<Entry> _lows;
+
+    double _notional = 0.0;
+    uint64_t _volume = 0;
+
+public:
+    /**
+     * @param length Window length in milliseconds, positive
+     */
+    explicit SlidingWindow(int64_t length) : _length(length) {}
+
+    /**
+     * Add a trade and slide the window to end at its timestamp
+     *
+     * @param timestamp Milliseconds since the epoch, not before earlier trades
+     * @param quantity Number of shares
+     * @param price Price per share
+     */
+    void add(int64_t timestamp, uint32_t quantity, double price) {
+        while (!_entries.empty() &&
+               _entries.front().timestamp <= timestamp - _length) {
+            const Entry &old = _entries.front();
+            _notional -= old.price * old.quantity;
+            _volume -= old.quantity;
+            if (_highs.front().sequence == old.sequence) {
+                _highs.pop_front();
+            }
+            if (_lows.front().sequence == old.sequence) {
+                _lows.pop_front();
+            }
+            _entries.pop_front();
+        }
+
+        // Restart the running notional whenever the window empties so
+        // rounding errors of the subtractions do not pile up
+        if (_entries.empty()) {
+            _notional = 0.0;
+        }
+
+        const Entry entry = {_sequence++, timestamp, quantity, price};
+        _entries.push_back(entry);
+        _notional += price * quantity;
+        _volume += quantity;
+
+        while (!_highs.empty() && _highs.back().price <= price) {
+            _highs.pop_back();
+        }
+        _highs.push_back(entry);
+
+        while (!_lows.empty() && _lows.back().price >= price) {
+            _lows.pop_back();
+        }
+        _lows.push_back(entry);
+    }
+
+    double vwap() const { return _volume ? _notional / (double)_volume : 0.0; }
+
+    double high() const { return _highs.empty() ? 0.0 : _highs.front().price; }
+
+    double low() const { return _lows.empty() ? 0.0 : _lows.front().price; }
+
+    uint64_t volume() const { return _volume; }
+
+    /**
+     * @return Timestamp of the latest trade, Stock::NO_TIMESTAMP if none
+     */
+    int64_t end() const {
+        return _entries.empty() ? Stock::NO_TIMESTAMP
+                                : _entries.back().timestamp;
+    }
+};
+
+/**
+ * Pool of fixed size resting order nodes addressed by index. Released nodes
+ * are chained into a free list and reused before the pool grows, so a
+ * matching session allocates only while its book keeps growing.
+ */
+class OrderPool {
+public:
+    static const uint32_t NIL = UINT32_MAX;
+
+    struct Node {
+        uint64_t id;
+        uint32_t quantity;
+
+        // Next order of the same price level, or next free node
+        uint32_t next;
+    };
+
+private:
+    vector<Node> _nodes;
+    uint32_t _free = NIL;
+
+public:
+    uint32_t allocate(uint64_t id, uint32_t quantity) {
+        uint32_t index = _free;
+        if (NIL != index) {
+            _free = _nodes[index].next;
+        } else {
+            index = (uint32_t)_nodes.size();
+            _nodes.emplace_back();
+        }
+
+        _nodes[index] = {id, quantity, NIL};
+        return index;
+    }
+
+    void release(uint32_t index) {
+        _nodes[index].next = _free;
+        _free = index;
+    }
+
+    Node &operator[](uint32_t index) { return _nodes[index]; }
+};
+
+/**
+ * Limit order books of all symbols with price-time priority.
+ *
+ * Each side of a book is a flat array of price levels sorted so that the
+ * best price is last: matching only touches the back of the array and an
+ * emptied best level is a pop_back. Each level holds an intrusive FIFO queue
+ * of orders, linked by index through a shared OrderPool.
+ */
+class MatchingEngine {
+private:
+    struct PriceLevel {
+        double price;
+        uint64_t quantity;
+        uint32_t head;
+        uint32_t tail;
+    };
+
+    struct Book {
+        // Bids ascending and asks descending by price
+        vector<PriceLevel> bids;
+        vector<PriceLevel> asks;
+    };
+
+    vector<Book> _books;
+    OrderPool _orders;
+    size_t _restingOrders[2] = {0, 0};
+
+    /**
+     * Queue the unfilled rest of an order at its price level
+     */
+    void rest(vector<PriceLevel> &levels, bool ascending, uint64_t id,
+              uint32_t quantity, double price) {
+        // First level that ranks after the price, the level of the price if
+        // any is right before it
+        auto position = upper_bound(
+            levels.begin(), levels.end(), price,
+            [ascending](double value, const PriceLevel &level) {
+                return ascending ? value < level.price : value > level.price;
+            });
+
+        const uint32_t node = _orders.allocate(id, quantity);
+        if (position != levels.begin() && (position - 1)->price == price) {
+            PriceLevel &level = *(position - 1);
+            _orders[level.tail].next = node;
+            level.tail = node;
+            level.quantity += quantity;
+        } else {
+            levels.insert(position, {price, quantity, node, node});
+        }
+    }
+
+public:
+    /**
+     * Match an incoming limit order against the opposite side of its book
+     * and rest whatever is left
+     *
+     * @param type Stock::BUY or Stock::SELL
+     * @param id Order id reported in fills
+     * @param quantity Number of shares
+     * @param symbolId Interned symbol id
+     * @param price Limit price per share
+     * @param fill Called with the resting order id, the incoming order id,
+     * the resting order's price and the quantity of each fill
+     * @return Quantity left resting in the book
+     */
+    template <typename Fill>
+    uint32_t submit(int type, uint64_t id, uint32_t quantity,
+                    uint32_t symbolId, double price, Fill fill) {
+        if (symbolId >= _books.size()) {
+            _books.resize(symbolId + 1);
+        }
+
+        Book &book = _books[symbolId];
+        const bool buy = Stock::BUY == type;
+        vector<PriceLevel> &opposite = buy ? book.asks : book.bids;
+        while (quantity && !opposite.empty()) {
+            PriceLevel &level = opposite.back();
+            if (buy ? level.price > price : level.price < price) {
+                break;
+            }
+
+            while (quantity && OrderPool::NIL != level.head) {
+                OrderPool::Node &order = _orders[level.head];
+                const uint32_t filled = min(quantity, order.quantity);
+                fill(order.id, id, level.price, filled);
+
+                order.quantity -= filled;
+                level.quantity -= filled;
+                quantity -= filled;
+                if (!order.quantity) {
+                    const uint32_t next = order.next;
+                    _orders.release(level.head);
+                    level.head = next;
+                    --_restingOrders[buy];
+                }
+            }
+
+            if (OrderPool::NIL == level.head) {
+                opposite.pop_back();
+            }
+        }
+
+        if (quantity) {
+            rest(buy ? book.bids : book.asks, buy, id, quantity, price);
+            ++_restingOrders[!buy];
+        }
+
+        return quantity;
+    }
+
+    /**
+     * @param type Stock::BUY or Stock::SELL
+     * @return Number of orders of that side resting in all books
+     */
+    size_t restingOrders(int type) const {
+        return _restingOrders[Stock::BUY != type];
+    }
+};
+
+/**
+ * Filters of the query command, all of which a transaction must pass.
+ *
+ * Filters are written as field, operator and value without spaces, e.g.
+ * "symbol=AAPL price>=100 qty<500". The fields are symbol and type, which
+ * only take '=', and price, qty and notional, which take any of '=', '<',
+ * '<=', '>' and '>='. Numeric filters are kept as closed ranges, strict
+ * bounds moved to the next representable value.
+ */
+struct TransactionQuery {
+    static const int PRICE = 0;
+    static const int QUANTITY = 1;
+    static const int NOTIONAL = 2;
+    static const int RANGES = 3;
+
+    // Symbol to match, empty for any
+    string symbol;
+
+    // Stock::BUY, Stock::SELL or 0 for either
+    int type = 0;
+
+    // Ranges of the price, quantity and notional, indexed by the above
+    double low[RANGES] = {-HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+    double high[RANGES] = {HUGE_VAL, HUGE_VAL, HUGE_VAL};
+
+    // Set when two filters contradict each other
+    bool none = false;
+
+    /**
+     * @return true if the range of a field is narrower than all values
+     */
+    bool bounded(int field) const {
+        return -HUGE_VAL != low[field] || HUGE_VAL != high[field];
+    }
+
+    /**
+     * Parse whitespace separated filters
+     *
+     * @param filters Filters as typed by the user
+     * @param bad Set to the offending filter on failure
+     * @return false if a filter is not valid
+     */
+    bool parse(const string &filters, string &bad) {
+        istringstream iss(filters);
+        string filter;
+        while (iss >> filter) {
+            if (!add(filter)) {
+                bad = filter;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    bool add(const string &filter) {
+        const size_t opBegin = filter.find_first_of("<>=");
+        if (string::npos == opBegin || !opBegin) {
+            return false;
+        }
+
+        size_t opEnd = opBegin + 1;
+        if ('=' != filter[opBegin] && opEnd < filter.size() &&
+            '=' == filter[opEnd]) {
+            ++opEnd;
+        }
+
+        const string field = filter.substr(0, opBegin);
+        const string op = filter.substr(opBegin, opEnd - opBegin);
+        const string value = filter.substr(opEnd);
+        if (value.empty()) {
+            return false;
+        }
+
+        if ("symbol" == field || "type" == field) {
+            if ("=" != op) {
+                return false;
+            }
+
+            if ("symbol" == field) {
+                none |= !symbol.empty() && symbol != value;
+                symbol = value;
+                return true;
+            }
+
+            const int valueType = "buy" == value    ? Stock::BUY
+                                  : "sell" == value ? Stock::SELL
+                                                    : 0;
+            if (!valueType) {
+                return false;
+            }
+            none |= type && type != valueType;
+            type = valueType;
+            return true;
+        }
+
+        int index;
+        if ("price" == field) {
+            index = PRICE;
+        } else if ("qty" == field || "quantity" == field) {
+            index = QUANTITY;
+        } else if ("notional" == field) {
+            index = NOTIONAL;
+        } else {
+            return false;
+        }
+
+        char *end;
+        const double number = strtod(value.c_str(), &end);
+        if (*end || !isfinite(number)) {
+            return false;
+        }
+
+        if ("<" == op || "<=" == op || "=" == op) {
+            high[index] = min(high[index],
+                              "<" == op ? nextafter(number, -HUGE_VAL)
+                                        : number);
+        }
+        if (">" == op || ">=" == op || "=" == op) {
+            low[index] = max(low[index],
+                             ">" == op ? nextafter(number, HUGE_VAL) : number);
+        }
+        return true;
+    }
+};
+
+/**
+ * Row numbers of a TransactionStore sorted by a key derived from the row,
+ * for range lookups.
+ *
+ * Rows are kept in sorted runs of decreasing size, each row with a copy of
+ * its key. A new batch becomes a run of its own, merged with the last run
+ * for as long as that run is no larger, as in a log-structured merge tree.
+ * There are then at most log2(N) runs, each row is moved O(log N) times
+ * however small the batches are, and a lookup is two binary searches per
+ * run. Ties are ordered by row number.
+ */
+class RangeIndex {
+private:
+    struct Run {
+        vector<double> keys;
+        vector<uint32_t> rows;
+
+        size_t size() const { return rows.size(); }
+
+        void push_back(double key, uint32_t row) {
+            keys.push_back(key);
+            rows.push_back(row);
+        }
+    };
+
+    // Oldest and largest first
+    vector<Run> _runs;
+
+    /**
+     * Merge two runs, the rows of newer all past those of older
+     */
+    static Run merge(const Run &older, const Run &newer) {
+        Run merged;
+        merged.keys.reserve(older.size() + newer.size());
+        merged.rows.reserve(older.size() + newer.size());
+        size_t i = 0, j = 0;
+        while (i < older.size() && j < newer.size()) {
+            // Ties go to the older run, whose rows come first
+            if (newer.keys[j] < older.keys[i]) {
+                merged.push_back(newer.keys[j], newer.rows[j]);
+                ++j;
+            } else {
+                merged.push_back(older.keys[i], older.rows[i]);
+                ++i;
+            }
+        }
+        for (; i < older.size(); ++i) {
+            merged.push_back(older.keys[i], older.rows[i]);
+        }
+        for (; j < newer.size(); ++j) {
+            merged.push_back(newer.keys[j], newer.rows[j]);
+        }
+
+        return merged;
+    }
+
+    /**
+     * Positions in a run of the rows with a key in [low, high]
+     */
+    static pair<size_t, size_t> range(const Run &run, double low,
+                                      double high) {
+        const auto first = lower_bound(run.keys.begin(), run.keys.end(), low);
+        const auto last = upper_bound(first, run.keys.end(), high);
+        return {(size_t)(first - run.keys.begin()),
+                (size_t)(last - run.keys.begin())};
+    }
+
+public:
+    /**
+     * Add rows [first, last), all past the rows added before
+     */
+    template <typename Key>
+    void add(uint32_t first, uint32_t last, const Key &key) {
+        if (first >= last) {
+            return;
+        }
+
+        vector<pair<double, uint32_t>> keyed;
+        keyed.reserve(last - first);
+        for (uint32_t row = first; row < last; ++row) {
+            keyed.emplace_back(key(row), row);
+        }
+        sort(keyed.begin(), keyed.end());
+
+        Run run;
+        run.keys.reserve(keyed.size());
+        run.rows.reserve(keyed.size());
+        for (const pair<double, uint32_t> &entry : keyed) {
+            run.push_back(entry.first, entry.second);
+        }
+
+        while (!_runs.empty() && _runs.back().size() <= run.size()) {
+            run = merge(_runs.back(), run);
+            _runs.pop_back();
+        }
+        _runs.push_back(move(run));
+    }
+
+    /**
+     * Number of rows with a key in [low, high]
+     */
+    size_t count(double low, double high) const {
+        size_t count = 0;
+        for (const Run &run : _runs) {
+            const pair<size_t, size_t> rows = range(run, low, high);
+            count += rows.second - rows.first;
+        }
+
+        return count;
+    }
+
+    /**
+     * Call visit with every row with a key in [low, high], not in row order
+     */
+    template <typename Visit>
+    void visit(double low, double high, Visit visit) const {
+        for (const Run &run : _runs) {
+            const pair<size_t, size_t> rows = range(run, low, high);
+            for (size_t i = rows.first; i < rows.second; ++i) {
+                visit(run.rows[i]);
+            }
+        }
+    }
+};
+
+/**
+ * Secondary indexes of a TransactionStore: the rows of each symbol, and the
+ * rows ordered by price, quantity and notional.
+ *
+ * The indexes are brought up to date with the rows appended since the last
+ * query when a query runs, so loads and inserts pay nothing until the first
+ * query and then only for the new rows. A query starts from the index
+ * expected to yield the fewest rows and checks the other filters on the
+ * columns.
+ */
+class TransactionIndex {
+private:
+    const TransactionStore &_store;
+
+    // Rows of each symbol id, in row order
+    vector<vector<uint32_t>> _bySymbol;
+
+    // Indexed by TransactionQuery::PRICE, QUANTITY and NOTIONAL
+    RangeIndex _byRange[TransactionQuery::RANGES];
+
+    // Rows indexed so far
+    size_t _rows = 0;
+
+    /**
+     * Key of a row for a TransactionQuery range field
+     */
+    struct Key {
+        const Money *prices;
+        const uint32_t *quantities;
+        int field;
+
+        double operator()(uint32_t row) const {
+            switch (field) {
+            case TransactionQuery::PRICE:
+                return prices[row].toDouble();
+            case TransactionQuery::QUANTITY:
+                return (double)quantities[row];
+            default:
+                return prices[row].toDouble() * (double)quantities[row];
+            }
+        }
+    };
+
+    Key key(int field) const {
+        return {_store.prices(), _store.quantities(), field};
+    }
+
+    /**
+     * Index the rows appended since the last update
+     */
+    void update() {
+        const size_t size = _store.size();
+        if (_rows == size) {
+            return;
+        }
+
+        const uint32_t *symbolIds = _store.symbolIds();
+        for (size_t row = _rows; row < size; ++row) {
+            if (symbolIds[row] >= _bySymbol.size()) {
+                _bySymbol.resize(symbolIds[row] + 1);
+            }
+            _bySymbol[symbolIds[row]].push_back((uint32_t)row);
+        }
+
+        for (int field = 0; field < TransactionQuery::RANGES; ++field) {
+            _byRange[field].add((uint32_t)_rows, (uint32_t)size, key(field));
+        }
+        _rows = size;
+    }
+
+public:
+    explicit TransactionIndex(const TransactionStore &store) : _store(store) {}
+
+    /**
+     * Find the transactions passing all filters of a query
+     *
+     * @param query Filters
+     * @return Matching row numbers in row order
+     */
+    vector<uint32_t> select(const TransactionQuery &query) {
+        update();
+
+        vector<uint32_t> rows;
+        uint32_t symbolId = 0;
+        if (query.none ||
+            (!query.symbol.empty() &&
+             (!SymbolTable::global().find(query.symbol, symbolId) ||
+              symbolId >= _bySymbol.size()))) {
+            return rows;
+        }
+        for (int field = 0; field < TransactionQuery::RANGES; ++field) {
+            if (query.low[field] > query.high[field]) {
+                return rows;
+            }
+        }
+
+        const uint8_t *types = _store.types();
+        const uint32_t *quantities = _store.quantities();
+        const Money *prices = _store.prices();
+        const uint32_t *symbolIds = _store.symbolIds();
+        auto matches = [&](uint32_t row) {
+            const double price = prices[row].toDouble();
+            const double quantity = (double)quantities[row];
+            const double notional = price * quantity;
+            return (query.symbol.empty() || symbolIds[row] == symbolId) &&
+                   (!query.type || types[row] == query.type) &&
+                   price >= query.low[TransactionQuery::PRICE] &&
+                   price <= query.high[TransactionQuery::PRICE] &&
+                   quantity >= query.low[TransactionQuery::QUANTITY] &&
+                   quantity <= query.high[TransactionQuery::QUANTITY] &&
+                   notional >= query.low[TransactionQuery::NOTIONAL] &&
+                   notional <= query.high[TransactionQuery::NOTIONAL];
+        };
+
+        // Start from the narrowest index, or scan if none applies
+        const int SCAN = -2, SYMBOL = -1;
+        int start = SCAN;
+        size_t candidates = _rows;
+        if (!query.symbol.empty()) {
+            start = SYMBOL;
+            candidates = _bySymbol[symbolId].size();
+        }
+        for (int field = 0; field < TransactionQuery::RANGES; ++field) {
+            if (query.bounded(field)) {
+                const size_t count =
+                    _byRange[field].count(query.low[field], query.high[field]);
+                if (count < candidates) {
+                    start = field;
+                    candidates = count;
+                }
+            }
+        }
+
+        if (SCAN == start) {
+            for (uint32_t row = 0; row < _rows; ++row) {
+                if (matches(row)) {
+                    rows.push_back(row);
+                }
+            }
+        } else if (SYMBOL == start) {
+            for (uint32_t row : _bySymbol[symbolId]) {
+                if (matches(row)) {
+                    rows.push_back(row);
+                }
+            }
+        } else {
+            _byRange[start].visit(query.low[start], query.high[start],
+                                  [&](uint32_t row) {
+                                      if (matches(row)) {
+                                          rows.push_back(row);
+                                      }
+                                  });
+            sort(rows.begin(), rows.end());
+        }
+
+        return rows;
+    }
+};
+
+/**
+ * Counters of a TradeQueue, sampled without stopping its threads
+ */
+struct IngestMetrics {
+    uint64_t enqueued = 0;
+    uint64_t dequeued = 0;
+
+    // Trades queued but not yet dequeued, and the most there ever were
+    uint64_t depth = 0;
+    uint64_t highWater = 0;
+
+    // Pushes that found the queue full and pops that found it empty
+    uint64_t fullWaits = 0;
+    uint64_t emptyWaits = 0;
+
+    // Trades dequeued but dropped because they could not be journaled
+    uint64_t dropped = 0;
+};
+
+/**
+ * Bounded multi-producer single-consumer lock-free ring buffer of trades.
+ *
+ * Each cell carries a sequence number that tells producers whether it is
+ * free for the position they claimed and tells the consumer whether it was
+ * published, so producers only contend on one compare-and-swap of the enqueue
+ * position and the consumer never writes a shared counter. A full queue makes
+ * producers spin, then yield, until the consumer catches up. An empty queue
+ * makes the consumer spin, then sleep until a producer signals it.
+ */
+class TradeQueue {
+public:
+    struct Trade {
+        int64_t timestamp;
+        Money price;
+        uint32_t quantity;
+        uint32_t symbolId;
+        int type;
+    };
+
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        Trade trade;
+    };
+
+    static const int SPINS = 64;
+
+    const size_t _mask;
+    unique_ptr<Cell[]> _cells;
+
+    alignas(64) atomic<size_t> _enqueuePos{0};
+    alignas(64) size_t _dequeuePos = 0;
+
+    // Dequeue position published to producers and metrics
+    atomic<size_t> _dequeued{0};
+
+    alignas(64) atomic<bool> _closed{false};
+
+    // Slow path of an empty queue, producers only lock it when the consumer
+    // is asleep
+    atomic<bool> _consumerWaiting{false};
+    mutex _lock;
+    condition_variable _published;
+
+    atomic<uint64_t> _fullWaits{0};
+    atomic<uint64_t> _emptyWaits{0};
+    atomic<uint64_t> _highWater{0};
+
+    static size_t roundUp(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    size_t dequeuedHint() const {
+        return _dequeued.load(memory_order_relaxed);
+    }
+
+    bool isEmpty() const {
+        return _cells[_dequeuePos & _mask].sequence.load(
+                   memory_order_acquire) != _dequeuePos + 1;
+    }
+
+public:
+    /**
+     * Allocate a queue aligned to its cache line aligned members, which plain
+     * new does not guarantee before C++17
+     */
+    static void *operator new(size_t size) {
+        void *memory = nullptr;
+        if (posix_memalign(&memory, alignof(TradeQueue), size)) {
+            throw bad_alloc();
+        }
+        return memory;
+    }
+
+    static void operator delete(void *memory) { free(memory); }
+
+    /**
+     * @param capacity Number of cells, rounded up to a power of 2
+     */
+    explicit TradeQueue(size_t capacity) : _mask(roundUp(capacity) - 1) {
+        _cells.reset(new Cell[_mask + 1]);
+        for (size_t i = 0; i <= _mask; ++i) {
+            _cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Queue a trade if there is room, safe to call from any thread
+     *
+     * @return false if the queue is full
+     */
+    bool tryPush(const Trade &trade) {
+        size_t pos = _enqueuePos.load(memory_order_relaxed);
+        Cell *cell;
+        for (;;) {
+            cell = &_cells[pos & _mask];
+            const size_t sequence = cell->sequence.load(memory_order_acquire);
+            const intptr_t difference = (intptr_t)sequence - (intptr_t)pos;
+            if (0 == difference) {
+                if (_enqueuePos.compare_exchange_weak(
+                        pos, pos + 1, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                pos = _enqueuePos.load(memory_order_relaxed);
+            }
+        }
+
+        cell->trade = trade;
+        cell->sequence.store(pos + 1, memory_order_release);
+
+        // Depth as seen by this producer, a lower bound of the true maximum
+        const uint64_t depth = pos + 1 - min(pos + 1, dequeuedHint());
+        uint64_t highWater = _highWater.load(memory_order_relaxed);
+        while (depth > highWater &&
+               !_highWater.compare_exchange_weak(highWater, depth,
+                                                 memory_order_relaxed)) {
+        }
+
+        if (_consumerWaiting.load(memory_order_seq_cst)) {
+            lock_guard<mutex> guard(_lock);
+            _published.notify_one();
+        }
+        return true;
+    }
+
+    /**
+     * Queue a trade, waiting while the queue is full
+     *
+     * @return false if the queue was closed
+     */
+    bool push(const Trade &trade) {
+        if (tryPush(trade)) {
+            return true;
+        }
+
+        _fullWaits.fetch_add(1, memory_order_relaxed);
+        for (int spin = 0;; ++spin) {
+            if (_closed.load(memory_order_acquire)) {
+                return false;
+            }
+            if (tryPush(trade)) {
+                return true;
+            }
+            if (spin >= SPINS) {
+                this_thread::yield();
+            }
+        }
+    }
+
+    /**
+     * Dequeue up to count trades, consumer thread only. Waits for a trade
+     * unless the queue is closed.
+     *
+     * @return Number of trades dequeued, 0 once closed and drained
+     */
+    size_t pop(Trade *trades, size_t count) {
+        for (int spin = 0;; ++spin) {
+            size_t popped = 0;
+            while (popped < count) {
+                Cell &cell = _cells[_dequeuePos & _mask];
+                if (cell.sequence.load(memory_order_acquire) !=
+                    _dequeuePos + 1) {
+                    break;
+                }
+                trades[popped++] = cell.trade;
+                cell.sequence.store(_dequeuePos + _mask + 1,
+                                    memory_order_release);
+                ++_dequeuePos;
+            }
+            if (popped) {
+                _dequeued.store(_dequeuePos, memory_order_relaxed);
+                return popped;
+            }
+
+            if (_closed.load(memory_order_acquire) && isEmpty()) {
+                return 0;
+            }
+
+            if (!spin) {
+                _emptyWaits.fetch_add(1, memory_order_relaxed);
+            }
+            if (spin >= SPINS) {
+                // Producers see the flag after their publish, and the timeout
+                // covers a publish that raced with setting it
+                unique_lock<mutex> guard(_lock);
+                _consumerWaiting.store(true, memory_order_seq_cst);
+                if (isEmpty() && !_closed.load(memory_order_acquire)) {
+                    _published.wait_for(guard, chrono::milliseconds(1));
+                }
+                _consumerWaiting.store(false, memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Stop accepting trades, the consumer still drains the queued ones
+     */
+    void close() {
+        _closed.store(true, memory_order_release);
+        lock_guard<mutex> guard(_lock);
+        _published.notify_one();
+    }
+
+    IngestMetrics metrics() const {
+        IngestMetrics metrics;
+        metrics.dequeued = dequeuedHint();
+        metrics.enqueued =
+            max(metrics.dequeued, (uint64_t)_enqueuePos.load());
+        metrics.depth = metrics.enqueued - metrics.dequeued;
+        metrics.highWater = _highWater.load(memory_order_relaxed);
+        metrics.fullWaits = _fullWaits.load(memory_order_relaxed);
+        metrics.emptyWaits = _emptyWaits.load(memory_order_relaxed);
+        return metrics;
+    }
+};
+
+/**
+ * Class implementing various commands and orchestration of stock transactions
+ */
+class Transactions {
+private:
+    // Allows reading/writing to file instead of console
+    istream &input;
+    ostream &output;
+
+    // All valid transactions performed so far
+    TransactionStore _transactions;
+
+    // Per-symbol positions, covering the first _positionRows transactions
+    PositionBook _positions;
+    size_t _positionRows = 0;
+
+    // Running totals of the summary and symbols commands
+    SummaryBook _summary{_transactions};
+
+    // Secondary indexes of the query command
+    TransactionIndex _index{_transactions};
+
+    // Threads used to parse transactions files
+    unsigned _jobs = 1;
+
+    // Journal of buy/sell commands, compacted into a snapshot named after it
+    // once it grows past _compactBytes
+    Journal _journal;
+    string _journalFile;
+    uint64_t _compactBytes = 0;
+
+    // Symbol filter of the analytics commands matching every symbol
+    static const uint32_t ALL_SYMBOLS = UINT32_MAX;
+
+    // Trades submitted by other threads are queued in _ingest and applied by
+    // the _consumer thread while it holds _storeLock, which commands also
+    // hold once their input is read
+    unique_ptr<TradeQueue> _ingest;
+    thread _consumer;
+    mutex _storeLock;
+    atomic<uint64_t> _ingestDropped{0};
+
+#if STATS_ENABLED
+    // Counters and latencies reported by the stats command
+    Stats _stats;
+#endif
+
+    /**
+     * Apply queued trades in batches until the queue is closed and drained.
+     * Journaled batches are made durable before they are recorded.
+     */
+    void consume() {
+        const size_t batchSize = 4096;
+        vector<TradeQueue::Trade> batch(batchSize);
+        const SymbolTable &symbols = SymbolTable::global();
+
+        size_t count;
+        while ((count = _ingest->pop(batch.data(), batchSize))) {
+            bool durable = true;
+            if (_journal.isOpen()) {
+                uint64_t sequence = 0;
+                for (size_t i = 0; i < count; ++i) {
+                    const TradeQueue::Trade &trade = batch[i];
+                    sequence = _journal.append(
+                        trade.type, trade.quantity,
+                        symbols.symbol(trade.symbolId), trade.price,
+                        trade.timestamp);
+                }
+                durable = _journal.waitDurable(sequence);
+            }
+
+            lock_guard<mutex> guard(_storeLock);
+            if (!durable) {
+                _ingestDropped += count;
+                continue;
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                const TradeQueue::Trade &trade = batch[i];
+                record(trade.type, trade.quantity, trade.symbolId,
+                       trade.price, trade.timestamp);
+            }
+
+            compactIfDue();
+        }
+    }
+
+    /**
+     * Show usage details
+     */
+    void usage() {
+        output << "usage: " << endl;
+        output << "\tbuy - Start a stock purchase/buy transaction" << endl;
+        output << "\tsell - Start a stock sell transaction" << endl;
+        output << "\tdisplay - Display all transactions" << endl;
+        output << "\tsummary - Display summary of buy & sell transactions"
+               << endl;
+        output << "\tsymbols - Display summary of buy & sell transactions "
+                  "per symbol"
+               << endl;
+        output << "\tposition - Display position and P&L of a stock" << endl;
+        output << "\tbars - Display OHLC bars of timestamped transactions"
+               << endl;
+        output << "\tvwap - Display the VWAP over a trailing time window"
+               << endl;
+        output << "\tmatch - Match buy and sell transactions as limit orders"
+               << endl;
+        output << "\tquery - Display transactions matching filters such as "
+                  "'symbol=AAPL price>=100 qty<500'"
+               << endl;
+        output << "\tingest - Display concurrent ingestion queue metrics"
+               << endl;
+        output << "\tsave - Save all transactions to a snapshot file" << endl;
+        output << "\tload - Load transactions from a text or snapshot file"
+               << endl;
+        output << "\tcompact - Compact the journal into its snapshot" << endl;
+#if STATS_ENABLED
+        output << "\tstats - Display row counters and command latencies"
+               << endl;
+#endif
+        output << "\texit - Quit the application." << endl;
+        output << "\thelp - Display this help message" << endl;
+    }
+
+    /**
+     * Store a validated transaction and update the aggregates derived from it
+     *
+     * @param stock Buy or sell transaction
+     */
+    void record(const Stock &stock) {
+        record(stock.getTransactionType(),
+               (uint32_t)stock.getNumberOfShares(), stock.getSymbolId(),
+               stock.getPricePerShare(), stock.getTimestamp());
+    }
+
+    /**
+     * Store a validated transaction given its fields
+     *
+     * @param type Stock::BUY or Stock::SELL
+     * @param quantity Number of shares
+     * @param symbolId Interned symbol id
+     * @param price Price per share
+     * @param timestamp Milliseconds since the epoch or Stock::NO_TIMESTAMP
+     */
+    void record(int type, uint32_t quantity, uint32_t symbolId, Money price,
+                int64_t timestamp) {
+        _transactions.append(type, quantity, symbolId, price, timestamp);
+        updatePositions();
+        _summary.update();
+    }
+
+    /**
+     * Current time in the unit of Stock timestamps
+     */
+    static int64_t now() {
+        return chrono::duration_cast<chrono::milliseconds>(
+                   chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    /**
+     * Bring the positions up to date with the stored transactions. Snapshots
+     * are served without touching their rows, so their positions are only
+     * aggregated once they are first needed.
+     */
+    void updatePositions() {
+        const uint8_t *types = _transactions.types();
+        const uint32_t *quantities = _transactions.quantities();
+        const Money *prices = _transactions.prices();
+        const uint32_t *symbolIds = _transactions.symbolIds();
+
+        for (; _positionRows < _transactions.size(); ++_positionRows) {
+            _positions.update(types[_positionRows], quantities[_positionRows],
+                              symbolIds[_positionRows],
+                              prices[_positionRows].toDouble());
+        }
+    }
+
+    /**
+     * Add the transactions of a snapshot. An empty store serves the snapshot
+     * straight from its mapping, otherwise the rows are appended.
+     *
+     * @param file Mapped snapshot
+     * @throws StockException if the snapshot is corrupted
+     */
+    void loadSnapshot(const shared_ptr<const MappedFile> &file) {
+        Snapshot::View view = Snapshot::open(file->data(), file->size());
+
+        if (!_transactions.size()) {
+            _transactions.view(file, view.types, view.quantities, view.prices,
+                               view.symbolIds, view.timestamps, view.count);
+            if (!view.identity) {
+                vector<uint32_t> symbolIds(view.count);
+                for (size_t i = 0; i < view.count; ++i) {
+                    symbolIds[i] = view.symbolMap[view.symbolIds[i]];
+                }
+                _transactions.assignSymbolIds(move(symbolIds));
+            }
+            if (!view.convertedPrices.empty()) {
+                _transactions.assignPrices(move(view.convertedPrices));
+            }
+            return;
+        }
+
+        _transactions.reserve(view.count);
+        for (size_t i = 0; i < view.count; ++i) {
+            record(view.types[i], view.quantities[i],
+                   view.symbolMap[view.symbolIds[i]], view.prices[i],
+                   view.timestamps ? view.timestamps[i] : Stock::NO_TIMESTAMP);
+        }
+    }
+
+    /**
+     * Append the transactions and report the diagnostics of a parsed chunk
+     *
+     * @param chunk Parsed chunk
+     * @param firstLine Line number of the first line of the chunk in its file
+     */
+    void merge(const LoadChunk &chunk, size_t firstLine) {
+#if STATS_ENABLED
+        chunk.addTo(_stats);
+#endif
+        chunk.errors.report(output, firstLine - 1);
+
+        _transactions.append(chunk.types.data(), chunk.quantities.data(),
+                             chunk.symbolIds.data(), chunk.prices.data(),
+                             chunk.timestamps.empty()
+                                 ? nullptr
+                                 : chunk.timestamps.data(),
+                             chunk.types.size());
+        updatePositions();
+        _summary.update();
+    }
+
+    /**
+     * Make a transaction durable in the journal, if one is open, before it is
+     * recorded
+     *
+     * @param stock Buy or sell transaction
+     * @throws StockException if the journal cannot be written
+     */
+    void journal(const Stock &stock) {
+        if (!_journal.isOpen()) {
+            return;
+        }
+
+        const uint64_t sequence = _journal.append(
+            stock.getTransactionType(), (uint32_t)stock.getNumberOfShares(),
+            stock.getSymbol(), stock.getPricePerShare(), stock.getTimestamp());
+        if (!_journal.waitDurable(sequence)) {
+            throw StockException(StockException::ERROR_JOURNAL_FAILURE,
+                                 "Ignored");
+        }
+    }
+
+    /**
+     * Make the rows recorded from a file loaded during the session durable
+     * in the journal, if one is open, so that they survive compaction and
+     * restarts like bought and sold transactions. _storeLock must be held.
+     *
+     * @param first First row of the loaded file
+     * @return false if the rows could not be journaled
+     */
+    bool journalRows(size_t first) {
+        const size_t size = _transactions.size();
+        if (!_journal.isOpen() || first == size) {
+            return true;
+        }
+
+        const uint8_t *types = _transactions.types();
+        const uint32_t *quantities = _transactions.quantities();
+        const Money *prices = _transactions.prices();
+        const uint32_t *symbolIds = _transactions.symbolIds();
+        const SymbolTable &symbols = SymbolTable::global();
+        uint64_t sequence = 0;
+        for (size_t row = first; row < size; ++row) {
+            sequence = _journal.append(types[row], quantities[row],
+                                       symbols.symbol(symbolIds[row]),
+                                       prices[row],
+                                       _transactions.timestamp(row));
+        }
+        if (!_journal.waitDurable(sequence)) {
+            output << "Error: " << size - first
+                   << " loaded transactions were not journaled and are kept "
+                      "for this session only"
+                   << endl;
+            return false;
+        }
+
+        compactIfDue();
+        return true;
+    }
+
+    /**
+     * Compact the journal once it grows past _compactBytes. _storeLock must
+     * be held, which keeps compactions from overlapping.
+     */
+    void compactIfDue() {
+        if (_journal.isOpen() && _journal.size() > _compactBytes) {
+            compact();
+        }
+    }
+
+    /**
+     * Implements compacting the journal: the records of the journal's
+     * snapshot and of the journal are written to a new snapshot, then the
+     * journal is emptied
+     *
+     * @return true if the journal was compacted
+     */
+    bool compact() {
+        if (!_journal.isOpen()) {
+            output << "No journal is open" << endl;
+            return false;
+        }
+
+        const string snapshotFile = _journalFile + ".snap";
+        TransactionStore compacted;
+        try {
+            // Records the snapshot already holds are not added again
+            JournalPosition covered;
+            MappedFile file;
+            if (file.open(snapshotFile)) {
+                Snapshot::View view = Snapshot::open(file.data(), file.size());
+                covered = view.journal;
+                compacted.reserve(view.count);
+                for (size_t i = 0; i < view.count; ++i) {
+                    compacted.append(view.types[i], view.quantities[i],
+                                     view.symbolMap[view.symbolIds[i]],
+                                     view.prices[i],
+                                     view.timestamps ? view.timestamps[i]
+                                                     : Stock::NO_TIMESTAMP);
+                }
+            }
+
+            const JournalPosition journaled = Journal::replay(
+                _journalFile, covered,
+                [&](int type, uint32_t quantity, const string &symbol,
+                    Money price, int64_t timestamp) {
+                    compacted.append(type, quantity,
+                                     SymbolTable::global().intern(symbol),
+                                     price, timestamp);
+                });
+
+            Snapshot::save(snapshotFile, compacted, journaled);
+            if (!_journal.truncate(journaled)) {
+                throw StockException(StockException::ERROR_JOURNAL_FAILURE,
+                                     "Journal not truncated");
+            }
+        } catch (const StockException &ex) {
+            output << ex.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Implements stock buy/purchase command
+     */
+    bool buy() {
+        bool status = false;
+
+        output << "Enter stock symbol to buy: ";
+        string symbol;
+        input >> symbol;
+
+        output << "Enter number of shares to buy: ";
+        int numShares;
+        input >> numShares;
+
+        output << "Enter price per share: ";
+        double pricePerShare;
+        input >> pricePerShare;
+
+        try {
+            BuyTransaction stock(numShares, symbol, pricePerShare, now());
+            journal(stock);
+
+            lock_guard<mutex> guard(_storeLock);
+            record(stock);
+            compactIfDue();
+            status = true;
+#if STATS_ENABLED
+            _stats.addValid(1);
+#endif
+        } catch (const StockException &ex) {
+#if STATS_ENABLED
+            _stats.addRejected(ex.getErrorCode());
+#endif
+            output << ex.what() << endl;
+        }
+
+        return status;
+    }
+
+    /**
+     * Implements stock sell transaction
+     */
+    bool sell() {
+        bool status = false;
+
+        output << "Enter stock symbol to sell: ";
+        string symbol;
+        input >> symbol;
+
+        output << "Enter number of shares to sell: ";
+        int numShares;
+        input >> numShares;
+
+        output << "Enter price per share: ";
+        double pricePerShare;
+        input >> pricePerShare;
+
+        try {
+            SellTransaction stock(numShares, symbol, pricePerShare, now());
+            journal(stock);
+
+            lock_guard<mutex> guard(_storeLock);
+            record(stock);
+            compactIfDue();
+            status = true;
+#if STATS_ENABLED
+            _stats.addValid(1);
+#endif
+        } catch (const StockException &ex) {
+#if STATS_ENABLED
+            _stats.addRejected(ex.getErrorCode());
+#endif
+            output << ex.what() << endl;
+        }
+
+        return status;
+    }
+
+    /**
+     * Implements command to display all stock transactions
+     */
+    void display() {
+        lock_guard<mutex> guard(_storeLock);
+        const uint8_t *types = _transactions.types();
+        const uint32_t *quantities = _transactions.quantities();
+        const Money *prices = _transactions.prices();
+        const uint32_t *symbolIds = _transactions.symbolIds();
+        const SymbolTable &symbols = SymbolTable::global();
+
+        // Lines are formatted into one reused buffer written in large blocks
+        const size_t blockSize = 1 << 20;
+        string block;
+        block.reserve(blockSize + 256);
+        for (size_t i = 0; i < _transactions.size(); ++i) {
+            block += '\t';
+            Stock::format(block, types[i], symbols.symbol(symbolIds[i]),
+                          prices[i], quantities[i]);
+            block += '\n';
+            if (block.size() >= blockSize) {
+                output.write(block.data(), (streamsize)block.size());
+                block.clear();
+            }
+        }
+        output.write(block.data(), (streamsize)block.size());
+        output.flush();
+    }
+
+    /**
+     * Implements displaying the summary of buy & sell transactions
+     */
+    void summary() {
+        lock_guard<mutex> guard(_storeLock);
+        printSummary(_summary.totals());
+    }
+
+    /**
+     * Implements displaying the summary of buy & sell transactions of each
+     * symbol
+     */
+    void symbols() {
+        lock_guard<mutex> guard(_storeLock);
+        printSymbolSummaries(_summary.bySymbol());
+    }
+
+    /**
+     * Write the summary line of the given totals
+     *
+     * @param totals Counts and notionals per side
+     * @param symbol Symbol the totals belong to, empty for all symbols
+     */
+    void printSummary(const SummaryTotals &totals, const string &symbol = "") {
+        const size_t totalBuyTransactions = totals.buyCount;
+        const size_t totalSellTransactions = totals.sellCount;
+
+        if (totals.overflow) {
+            StockException::write(output,
+                                  StockException::ERROR_AMOUNT_OVERFLOW,
+                                  "Totals are incomplete");
+            output << endl;
+        }
+
+        output << "\t";
+        if (!symbol.empty()) {
+            output << "SYMBOL(" << symbol << ") ";
+        }
+        output << "BUY-transactions(" << totalBuyTransactions << ") BUY-total($"
+               << totals.buyTotal.toFixed2() << ")  SELL-transactions("
+               << totalSellTransactions << ") SELL-total($"
+               << totals.sellTotal.toFixed2() << ")" << endl;
+    }
+
+    /**
+     * Write the summary lines of the symbols with transactions, in symbol
+     * order
+     *
+     * @param bySymbol Totals indexed by symbol id
+     */
+    void printSymbolSummaries(const vector<SummaryTotals> &bySymbol) {
+        // Symbol ids depend on which thread saw a symbol first
+        const SymbolTable &symbols = SymbolTable::global();
+        vector<uint32_t> order;
+        for (uint32_t symbolId = 0; symbolId < bySymbol.size(); ++symbolId) {
+            if (bySymbol[symbolId].buyCount || bySymbol[symbolId].sellCount) {
+                order.push_back(symbolId);
+            }
+        }
+        sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return symbols.symbol(a) < symbols.symbol(b);
+        });
+        for (uint32_t symbolId : order) {
+            printSummary(bySymbol[symbolId], symbols.symbol(symbolId));
+        }
+    }
+
+    /**
+     * Implements displaying the position and realized P&L of a stock
+     */
+    void position() {
+        output << "Enter stock symbol: ";
+        string symbol;
+        input >> symbol;
+
+        lock_guard<mutex> guard(_storeLock);
+        updatePositions();
+
+        uint32_t symbolId;
+        const SymbolPosition *pos = nullptr;
+        if (SymbolTable::global().find(symbol, symbolId)) {
+            pos = _positions.find(symbolId);
+        }
+
+        if (!pos) {
+            output << "No transactions for symbol '" << symbol << "'" << endl;
+            return;
+        }
+
+        output << fixed;
+        output << "\tSYMBOL(" << symbol << ") POSITION(" << pos->position
+               << ") AVG-COST($" << setprecision(2) << pos->averageCost
+               << ") REALIZED-FIFO($" << pos->realizedFifo
+               << ") REALIZED-AVG($" << pos->realizedAverage << ") BOUGHT("
+               << pos->boughtShares << ") SOLD(" << pos->soldShares << ")"
+               << endl;
+    }
+
+    /**
+     * Prompt for the symbol and interval length of an analytics command
+     *
+     * @param lengthPrompt Prompt for the interval length in seconds
+     * @param symbolId Set to the symbol id, ALL_SYMBOLS for '*'
+     * @param length Set to the interval length in milliseconds
+     * @return false if the symbol was never traded or the length is invalid
+     */
+    bool readInterval(const char *lengthPrompt, uint32_t &symbolId,
+                      int64_t &length) {
+        output << "Enter stock symbol ('*' for all): ";
+        string symbol;
+        input >> symbol;
+
+        output << lengthPrompt;
+        long long seconds = 0;
+        input >> seconds;
+
+        symbolId = ALL_SYMBOLS;
+        if ("*" != symbol && !SymbolTable::global().find(symbol, symbolId)) {
+            output << "No transactions for symbol '" << symbol << "'" << endl;
+            return false;
+        }
+
+        if (seconds <= 0 || seconds > INT64_MAX / 1000) {
+            output << "Invalid length: " << seconds << endl;
+            return false;
+        }
+
+        length = seconds * 1000;
+        return true;
+    }
+
+    /**
+     * Report the transactions an analytics command could not place in time
+     */
+    void reportSkipped(size_t skipped) {
+        if (skipped) {
+            output << "Skipped " << skipped
+                   << " transactions without timestamp or out of time order"
+                   << endl;
+        }
+    }
+
+    /**
+     * Implements displaying tumbling OHLC bars. Bars are aligned to multiples
+     * of their length since the epoch and each is printed once the first
+     * trade past it shows up, the open bars at the end in symbol order.
+     */
+    void bars() {
+        uint32_t selected;
+        int64_t length;
+        if (!readInterval("Enter bar length in seconds: ", selected, length)) {
+            return;
+        }
+
+        lock_guard<mutex> guard(_storeLock);
+        const uint32_t *symbolIds = _transactions.symbolIds();
+        const uint32_t *quantities = _transactions.quantities();
+        const Money *prices = _transactions.prices();
+        const SymbolTable &symbols = SymbolTable::global();
+
+        output << fixed << setprecision(2);
+        auto print = [&](uint32_t symbolId, const OhlcBar &bar) {
+            output << "\tSYMBOL(" << symbols.symbol(symbolId) << ") TIME("
+                   << bar.start << ") OPEN($" << bar.open << ") HIGH($"
+                   << bar.high << ") LOW($" << bar.low << ") CLOSE($"
+                   << bar.close << ") VOLUME(" << bar.volume << ") VWAP($"
+                   << bar.vwap() << ")\n";
+        };
+
+        // Open bar of every symbol, indexed by symbol id
+        vector<OhlcBar> current(symbols.size());
+        size_t skipped = 0;
+        for (size_t i = 0; i < _transactions.size(); ++i) {
+            const uint32_t symbolId = symbolIds[i];
+            if (ALL_SYMBOLS != selected && selected != symbolId) {
+                continue;
+            }
+
+            const int64_t timestamp = _transactions.timestamp(i);
+            OhlcBar &bar = current[symbolId];
+            if (Stock::NO_TIMESTAMP == timestamp || timestamp < bar.start) {
+                ++skipped;
+                continue;
+            }
+
+            const int64_t start = timestamp - timestamp % length;
+            if (start == bar.start) {
+                bar.add(quantities[i], prices[i].toDouble());
+                continue;
+            }
+
+            if (Stock::NO_TIMESTAMP != bar.start) {
+                print(symbolId, bar);
+            }
+            bar.begin(start, quantities[i], prices[i].toDouble());
+        }
+
+        for (uint32_t symbolId = 0; symbolId < current.size(); ++symbolId) {
+            if (Stock::NO_TIMESTAMP != current[symbolId].start) {
+                print(symbolId, current[symbolId]);
+            }
+        }
+        reportSkipped(skipped);
+    }
+
+    /**
+     * Implements displaying the VWAP, high, low and volume of the trailing
+     * time window ending at each trade
+     */
+    void vwap() {
+        uint32_t selected;
+        int64_t length;
+        if (!readInterval("Enter window length in seconds: ", selected,
+                          length)) {
+            return;
+        }
+
+        lock_guard<mutex> guard(_storeLock);
+        const uint32_t *symbolIds = _transactions.symbolIds();
+        const uint32_t *quantities = _transactions.quantities();
+        const Money *prices = _transactions.prices();
+        const SymbolTable &symbols = SymbolTable::global();
+
+        // Window of every symbol, created on its first trade
+        vector<unique_ptr<SlidingWindow>> windows(symbols.size());
+        size_t skipped = 0;
+        output << fixed << setprecision(2);
+        for (size_t i = 0; i < _transactions.size(); ++i) {
+            const uint32_t symbolId = symbolIds[i];
+            if (ALL_SYMBOLS != selected && selected != symbolId) {
+                continue;
+            }
+
+            const int64_t timestamp = _transactions.timestamp(i);
+            unique_ptr<SlidingWindow> &window = windows[symbolId];
+            if (!window) {
+                window.reset(new SlidingWindow(length));
+            }
+            if (Stock::NO_TIMESTAMP == timestamp || timestamp < window->end()) {
+                ++skipped;
+                continue;
+            }
+
+            window->add(timestamp, quantities[i], prices[i].toDouble());
+            output << "\tSYMBOL(" << symbols.symbol(symbolId) << ") TIME("
+                   << timestamp << ") VWAP($" << window->vwap() << ") HIGH($"
+                   << window->high() << ") LOW($" << window->low()
+                   << ") VOLUME(" << window->volume() << ")\n";
+        }
+        reportSkipped(skipped);
+    }
+
+    /**
+     * Implements matching all transactions, in the order they were recorded,
+     * as limit orders in per-symbol order books. Order ids are the positions
+     * of the transactions, starting at 1.
+     */
+    void match() {
+        output << "Show fills (y/n): ";
+        string answer;
+        input >> answer;
+        const bool showFills = "y" == answer || "Y" == answer;
+
+        lock_guard<mutex> guard(_storeLock);
+        const uint8_t *types = _transactions.types();
+        const uint32_t *quantities = _transactions.quantities();
+        const Money *prices = _transactions.prices();
+        const uint32_t *symbolIds = _transactions.symbolIds();
+        const SymbolTable &symbols = SymbolTable::global();
+
+        MatchingEngine engine;
+        size_t fills = 0;
+        uint64_t matchedShares = 0;
+        const size_t blockSize = 1 << 20;
+        string block;
+        for (size_t i = 0; i < _transactions.size(); ++i) {
+            const bool buy = Stock::BUY == types[i];
+            const uint32_t symbolId = symbolIds[i];
+            engine.submit(types[i], i + 1, quantities[i], symbolId,
+                          prices[i].toDouble(),
+                          [&](uint64_t resting, uint64_t incoming,
+                              double price, uint32_t quantity) {
+                              ++fills;
+                              matchedShares += quantity;
+                              if (!showFills) {
+                                  return;
+                              }
+
+                              block += "\tFILL SYMBOL(";
+                              block += symbols.symbol(symbolId);
+                              block += ") BUY(#";
+                              TextFormat::appendUnsigned(
+                                  block, buy ? incoming : resting);
+                              block += ") SELL(#";
+                              TextFormat::appendUnsigned(
+                                  block, buy ? resting : incoming);
+                              block += ") PRICE($";
+                              TextFormat::appendFixed2(block, price);
+                              block += ") QUANTITY(";
+                              TextFormat::appendUnsigned(block, quantity);
+                              block += ")\n";
+                          });
+
+            if (block.size() >= blockSize) {
+                output.write(block.data(), (streamsize)block.size());
+                block.clear();
+            }
+        }
+        output.write(block.data(), (streamsize)block.size());
+
+        output << "\tORDERS(" << _transactions.size() << ") FILLS(" << fills
+               << ") MATCHED-SHARES(" << matchedShares << ") RESTING-BUYS("
+               << engine.restingOrders(Stock::BUY) << ") RESTING-SELLS("
+               << engine.restingOrders(Stock::SELL) << ")" << endl;
+    }
+
+    /**
+     * Implements displaying the transactions that pass all of the filters
+     * typed after the command, see TransactionQuery
+     */
+    void query() {
+        output << "Enter filters (symbol, type, price, qty, notional): ";
+        string filters, bad;
+        getline(input >> ws, filters);
+
+        TransactionQuery query;
+        if (!query.parse(filters, bad)) {
+            output << "Invalid filter '" << bad << "', please retry." << endl;
+            return;
+        }
+
+        lock_guard<mutex> guard(_storeLock);
+        const vector<uint32_t> rows = _index.select(query);
+        const uint8_t *types = _transactions.types();
+        const uint32_t *quantities = _transactions.quantities();
+        const Money *prices = _transactions.prices();
+        const uint32_t *symbolIds = _transactions.symbolIds();
+        const SymbolTable &symbols = SymbolTable::global();
+
+        const size_t blockSize = 1 << 20;
+        string block;
+        block.reserve(blockSize + 256);
+        for (uint32_t row : rows) {
+            block += '\t';
+            Stock::format(block, types[row], symbols.symbol(symbolIds[row]),
+                          prices[row], quantities[row]);
+            block += '\n';
+            if (block.size() >= blockSize) {
+                output.write(block.data(), (streamsize)block.size());
+                block.clear();
+            }
+        }
+        output.write(block.data(), (streamsize)block.size());
+        output << "\tMATCHES(" << rows.size() << ")" << endl;
+    }
+
+    /**
+     * Implements displaying the metrics of the concurrent ingestion queue
+     */
+    void ingest() {
+        if (!_ingest) {
+            output << "Ingestion is not running" << endl;
+            return;
+        }
+
+        const IngestMetrics metrics = ingestMetrics();
+        output << "\tENQUEUED(" << metrics.enqueued << ") DEQUEUED("
+               << metrics.dequeued << ") DEPTH(" << metrics.depth
+               << ") HIGH-WATER(" << metrics.highWater << ") FULL-WAITS("
+               << metrics.fullWaits << ") EMPTY-WAITS(" << metrics.emptyWaits
+               << ") DROPPED(" << metrics.dropped << ")" << endl;
+    }
+
+#if STATS_ENABLED
+    /**
+     * Implements displaying the row counters and latency histograms
+     */
+    void stats() { _stats.report(output); }
+#endif
+
+    /**
+     * Implements saving all transactions to a snapshot file
+     */
+    void save() {
+        output << "Enter snapshot file name: ";
+        string fileName;
+        input >> fileName;
+
+        try {
+            lock_guard<mutex> guard(_storeLock);
+            Snapshot::save(fileName, _transactions);
+            output << "Saved " << _transactions.size()
+                   << " transactions to snapshot: " << fileName << endl;
+        } catch (const StockException &ex) {
+            output << ex.what() << endl;
+        }
+    }
+
+public:
+    Transactions() : Transactions(cin, cout) {}
+    Transactions(istream &in, ostream &out) : input(in), output(out) {}
+
+    virtual ~Transactions() { stopIngest(); }
+
+    // submit() result when the queue is full and the caller does not wait
+    static const int QUEUE_FULL = 1;
+
+    /**
+     * Start accepting trades from submit() on any thread. They are applied
+     * by a consumer thread in submission order per producer. Call before the
+     * producers start.
+     *
+     * @param capacity Number of trades the queue holds before producers wait
+     */
+    void startIngest(size_t capacity = 1 << 16) {
+        if (!_ingest) {
+            _ingest.reset(new TradeQueue(capacity));
+            _consumer = thread(&Transactions::consume, this);
+        }
+    }
+
+    /**
+     * Stop accepting trades and wait until the queued ones are applied.
+     * Producers must be done submitting.
+     */
+    void stopIngest() {
+        if (_ingest) {
+            _ingest->close();
+            _consumer.join();
+            _ingest.reset();
+        }
+    }
+
+    /**
+     * Submit a trade, safe to call from any thread. The trade is validated
+     * like a Stock and queued for the consumer if ingestion is running,
+     * otherwise it is made durable in the journal, if one is open, and
+     * recorded right away as buy and sell do.
+     *
+     * @param type Stock::BUY or Stock::SELL
+     * @param quantity Number of shares
+     * @param symbol Stock symbol
+     * @param price Price per share
+     * @param timestamp Milliseconds since the epoch or Stock::NO_TIMESTAMP
+     * @param wait Wait for room when the queue is full
+     * @return 0 on success, QUEUE_FULL if the queue is full and wait is
+     * false, else the StockException error code
+     */
+    int submit(int type, int quantity, const string &symbol, double price,
+               int64_t timestamp = Stock::NO_TIMESTAMP, bool wait = true) {
+        const Money pricePerShare = Stock::toPrice(price);
+        int error = StockException::ERROR_MALFORMED_RECORD;
+        if (Stock::BUY == type || Stock::SELL == type) {
+            error = Stock::validate(quantity, symbol.data(), symbol.size(),
+                                    pricePerShare);
+        }
+        if (error) {
+#if STATS_ENABLED
+            _stats.addRejected(error);
+#endif
+            return error;
+        }
+
+        const TradeQueue::Trade trade = {
+            timestamp, pricePerShare, (uint32_t)quantity,
+            SymbolTable::global().intern(symbol), type};
+        if (!_ingest) {
+            if (_journal.isOpen()) {
+                const uint64_t sequence =
+                    _journal.append(trade.type, trade.quantity, symbol,
+                                    trade.price, trade.timestamp);
+                if (!_journal.waitDurable(sequence)) {
+#if STATS_ENABLED
+                    _stats.addRejected(StockException::ERROR_JOURNAL_FAILURE);
+#endif
+                    return StockException::ERROR_JOURNAL_FAILURE;
+                }
+            }
+
+            lock_guard<mutex> guard(_storeLock);
+            record(trade.type, trade.quantity, trade.symbolId, trade.price,
+                   trade.timestamp);
+            compactIfDue();
+        } else if (!(wait ? _ingest->push(trade) : _ingest->tryPush(trade))) {
+            return QUEUE_FULL;
+        }
+
+#if STATS_ENABLED
+        _stats.addValid(1);
+#endif
+        return 0;
+    }
+
+#if STATS_ENABLED
+    /**
+     * Write the row counters and latency histograms to a file
+     *
+     * @param fileName Path of the file, replaced if it exists
+     * @return false if the file could not be written
+     */
+    bool writeStats(const string &fileName) const {
+        ofstream ofs(fileName);
+        if (ofs.is_open()) {
+            _stats.report(ofs);
+            ofs.close();
+        }
+
+        return !ofs.fail();
+    }
+#endif
+
+    /**
+     * Metrics of the ingestion queue, zero if ingestion is not running
+     */
+    IngestMetrics ingestMetrics() const {
+        IngestMetrics metrics;
+        if (_ingest) {
+            metrics = _ingest->metrics();
+        }
+        metrics.dropped = _ingestDropped.load();
+        return metrics;
+    }
+
+    /**
+     * Set the number of threads used to parse transactions files
+     *
+     * @param jobs Number of threads, at least 1
+     */
+    void setJobs(unsigned jobs) { _jobs = max(1u, jobs); }
+
+    /**
+     * Open the journal that makes buy and sell commands durable. Transactions
+     * journaled by earlier sessions are recorded first: those compacted into
+     * the snapshot fileName.snap, then those still in the journal.
+     *
+     * @param fileName Path of the journal, created if missing
+     * @param latency Longest time a transaction waits for its batch to commit
+     * @param compactBytes Journal size that triggers a compaction
+     * @return true if the journal was replayed and opened
+     */
+    bool openJournal(const string &fileName, chrono::microseconds latency,
+                     uint64_t compactBytes) {
+        _journalFile = fileName;
+        _compactBytes = compactBytes;
+
+        const string snapshotFile = fileName + ".snap";
+        if (0 == access(snapshotFile.c_str(), F_OK) &&
+            !loadFile(snapshotFile)) {
+            return false;
+        }
+
+        try {
+            // Records compacted into the snapshot may still be journaled if
+            // the last compaction was cut short
+            JournalPosition covered;
+            MappedFile snapshot;
+            if (snapshot.open(snapshotFile)) {
+                covered =
+                    Snapshot::journalPosition(snapshot.data(), snapshot.size());
+            }
+
+            bool current = true;
+            JournalPosition valid = Journal::replay(
+                fileName, covered,
+                [&](int type, uint32_t quantity, const string &symbol,
+                    Money price, int64_t timestamp) {
+                    record(type, quantity,
+                           SymbolTable::global().intern(symbol), price,
+                           timestamp);
+                },
+                &current);
+
+            // A new journal must not be mistaken for the one the snapshot
+            // covers
+            if (!valid.offset) {
+                valid.generation = covered.generation + 1;
+            }
+
+            if (!_journal.open(fileName, valid, latency)) {
+                throw StockException(StockException::ERROR_JOURNAL_FAILURE,
+                                     "Cannot open " + fileName);
+            }
+
+            // Records of an older format move into the snapshot before new
+            // ones are appended
+            if (!current && !compact()) {
+                _journal.close();
+                throw StockException(StockException::ERROR_JOURNAL_FAILURE,
+                                     "Cannot upgrade " + fileName);
+            }
+        } catch (const StockException &ex) {
+            output << ex.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Load transactions from a text file in the format described at load(),
+     * or from a snapshot written by the save command
+     *
+     * @param fileName Path of the file
+     * @return true if the file was loaded
+     */
+    bool loadFile(const string &fileName) {
+        shared_ptr<MappedFile> file = make_shared<MappedFile>();
+        if (!file->open(fileName)) {
+            output << "Error loading transaction data from file: " << fileName
+                   << endl;
+            return false;
+        }
+
+        output << "Loading transaction data from file: " << fileName << endl;
+        if (!Snapshot::matches(file->data(), file->size())) {
+            load(file->data(), file->size(), _jobs);
+            return true;
+        }
+
+        try {
+            loadSnapshot(file);
+        } catch (const StockException &ex) {
+            output << ex.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Print the summary of transactions files, followed by the totals of each
+     * symbol in symbol order, in a single pass that never stores the
+     * transactions. Files are read in blocks, parsed on up to the configured
+     * number of threads, so memory stays bounded whatever their size. "-"
+     * reads stdin, for archives piped through a decompressor.
+     *
+     * The overall totals are the same as those of the summary command after
+     * loading the files. The totals of each symbol are plain running sums.
+     *
+     * @param fileNames Paths of the transactions files, in order
+     * @return false if a file could not be read
+     */
+    bool summarize(const vector<string> &fileNames) {
+        const size_t blockSize = 8 << 20;
+        SummaryKernel::Accumulator accumulator;
+        vector<SummaryTotals> bySymbol;
+        vector<char> buffer(_jobs * blockSize);
+        bool ok = true;
+
+        for (const string &fileName : fileNames) {
+            const bool isStdin = "-" == fileName;
+            const int fd =
+                isStdin ? STDIN_FILENO : ::open(fileName.c_str(), O_RDONLY);
+            if (fd < 0) {
+                output << "Error loading transaction data from file: "
+                       << fileName << endl;
+                ok = false;
+                continue;
+            }
+#if defined(POSIX_FADV_SEQUENTIAL)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+            size_t used = 0, firstLine = 1;
+            bool eof = false;
+            while (!eof) {
+                // Fill the buffer, growing it for lines longer than itself
+                if (used == buffer.size()) {
+                    buffer.resize(buffer.size() * 2);
+                }
+                while (used < buffer.size()) {
+                    const ssize_t count =
+                        read(fd, buffer.data() + used, buffer.size() - used);
+                    if (count < 0 && EINTR == errno) {
+                        continue;
+                    }
+                    if (count <= 0) {
+                        eof = true;
+                        if (count < 0) {
+                            output << "Error reading transaction data from "
+                                      "file: "
+                                   << fileName << endl;
+                            ok = false;
+                        }
+                        break;
+                    }
+                    used += (size_t)count;
+                }
+
+                // Parse up to the last complete line, the rest is carried
+                // over to the next fill
+                size_t size = used;
+                if (!eof) {
+                    while (size && '\n' != buffer[size - 1]) {
+                        --size;
+                    }
+                    if (!size) {
+                        continue;
+                    }
+                }
+
+                vector<unique_ptr<LoadChunk>> chunks =
+                    LoadChunk::split(buffer.data(), size, blockSize);
+                vector<thread> workers;
+                for (size_t i = 1; i < chunks.size(); ++i) {
+                    workers.emplace_back(&LoadChunk::parse, chunks[i].get());
+                }
+                if (!chunks.empty()) {
+                    chunks[0]->parse();
+                }
+                for (thread &worker : workers) {
+                    worker.join();
+                }
+
+                for (const unique_ptr<LoadChunk> &chunk : chunks) {
+#if STATS_ENABLED
+                    chunk->addTo(_stats);
+#endif
+                    chunk->errors.report(output, firstLine - 1);
+                    firstLine += chunk->lines;
+
+                    const size_t rows = chunk->types.size();
+                    accumulator.add(chunk->types.data(),
+                                    chunk->quantities.data(),
+                                    chunk->prices.data(), rows);
+                    for (size_t i = 0; i < rows; ++i) {
+                        const uint32_t symbolId = chunk->symbolIds[i];
+                        if (symbolId >= bySymbol.size()) {
+                            bySymbol.resize(symbolId + 1);
+                        }
+
+                        bySymbol[symbolId].add(chunk->types[i],
+                                               chunk->quantities[i],
+                                               chunk->prices[i]);
+                    }
+                }
+
+                memmove(buffer.data(), buffer.data() + size, used - size);
+                used -= size;
+            }
+
+            if (!isStdin) {
+                ::close(fd);
+            }
+        }
+
+        printSummary(accumulator.totals());
+        printSymbolSummaries(bySymbol);
+
+        return ok;
+    }
+
+    /**
+     * Main command loop with user interaction to perform various stock
+     * transactions
+     */
+    void run() {
+        string cmd = "help";
+        output << endl;
+
+        while ("exit" != cmd) {
+            // Commands lock the store once their input is read, so ingested
+            // trades are not held up while a user types
+#if STATS_ENABLED
+            const chrono::steady_clock::time_point start =
+                chrono::steady_clock::now();
+            bool known = true;
+#endif
+            if ("help" == cmd) {
+                usage();
+            } else if ("buy" == cmd) {
+                buy();
+            } else if ("sell" == cmd) {
+                sell();
+            } else if ("display" == cmd) {
+                display();
+            } else if ("summary" == cmd) {
+                summary();
+            } else if ("symbols" == cmd) {
+                symbols();
+            } else if ("position" == cmd) {
+                position();
+            } else if ("bars" == cmd) {
+                bars();
+            } else if ("vwap" == cmd) {
+                vwap();
+            } else if ("match" == cmd) {
+                match();
+            } else if ("query" == cmd) {
+                query();
+            } else if ("ingest" == cmd) {
+                ingest();
+            } else if ("save" == cmd) {
+                save();
+            } else if ("compact" == cmd) {
+                lock_guard<mutex> guard(_storeLock);
+                compact();
+#if STATS_ENABLED
+            } else if ("stats" == cmd) {
+                stats();
+#endif
+            } else if ("load" == cmd) {
+                output << "Enter file name to load: ";
+                string fileName;
+                input >> fileName;
+                lock_guard<mutex> guard(_storeLock);
+                const size_t first = _transactions.size();
+                if (loadFile(fileName)) {
+                    journalRows(first);
+                }
+            } else if ("exit" != cmd) {
+                output << "Invalid command '" << cmd << "', please retry."
+                       << endl;
+#if STATS_ENABLED
+                known = false;
+#endif
+            }
+#if STATS_ENABLED
+            if (known && "exit" != cmd) {
+                _stats.histogram(cmd).record(Stats::since(start));
+            }
+#endif
+
+            output << endl
+                   << "Enter a command, ('help' for usage OR 'exit' to quit): ";
+            input >> cmd;
+        }
+    }
+
+    /**
+     * Optionally load transactions from a file
+     *
+     * Contains multiple lines in the below format
+     * transaction_type  quantity symbol price_per_share [timestamp]
+     *
+     * transaction_type: Integer, 1 (buy) or 2 (sell)
+     * quantity: Integer, number of shares to transact
+     * symbol: String, stock symbol
+     * price_per_share: Double, price per share in '$'
+     * timestamp: Optional integer, milliseconds since the epoch
+     *
+     * The records are scanned in place, typically straight out of a
+     * MappedFile. Lines that do not have the above format are reported with
+     * their line number and skipped.
+     *
+     * With more than one job the contents are split into newline aligned
+     * chunks that are parsed on a pool of threads and merged in file order, so
+     * the transactions and diagnostics are the same as with a single job.
+     *
+     * @param data Contents of the transactions file
+     * @param size Size of the contents in bytes
+     * @param jobs Number of threads parsing chunks
+     */
+    void load(const char *data, size_t size, unsigned jobs = 1) {
+        // Enough chunks to balance the threads, small enough that parsed
+        // chunks waiting to be merged stay bounded
+        const size_t minChunk = 1 << 20, maxChunk = 64 << 20;
+        const size_t chunkSize =
+            max(minChunk, min(maxChunk, size / (jobs * (size_t)8) + 1));
+        vector<unique_ptr<LoadChunk>> chunks =
+            LoadChunk::split(data, size, chunkSize);
+        jobs = (unsigned)min((size_t)jobs, chunks.size());
+
+        // One record per line, reserve up front so the columns are not over
+        // allocated by geometric growth
+        _transactions.reserve(RecordScanner::countLines(data, size) + 1);
+
+        mutex lock;
+        condition_variable parsed;
+        vector<bool> done(chunks.size(), false);
+        atomic<size_t> next(0);
+
+        auto parseChunk = [&](size_t index) {
+            chunks[index]->parse();
+
+            lock_guard<mutex> guard(lock);
+            done[index] = true;
+            parsed.notify_all();
+        };
+
+        vector<thread> workers;
+        for (unsigned i = 1; i < jobs; ++i) {
+            workers.emplace_back([&]() {
+                size_t index;
+                while ((index = next++) < chunks.size()) {
+                    parseChunk(index);
+                }
+            });
+        }
+
+        // Merge in file order. This thread helps parsing while the chunk to
+        // merge next is not ready yet.
+        size_t firstLine = 1;
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            for (;;) {
+                {
+                    lock_guard<mutex> guard(lock);
+                    if (done[i]) {
+                        break;
+                    }
+                }
+
+                const size_t index = next++;
+                if (index < chunks.size()) {
+                    parseChunk(index);
+                } else {
+                    unique_lock<mutex> guard(lock);
+                    parsed.wait(guard, [&]() { return (bool)done[i]; });
+                }
+            }
+
+            merge(*chunks[i], firstLine);
+            firstLine += chunks[i]->lines;
+            chunks[i].reset();
+        }
+
+        for (thread &worker : workers) {
+            worker.join();
+        }
+    }
+};
+
+#ifdef TRANSACT_STOCKS_BENCH
+
+/**
+ * Stream buffer that counts and discards everything written to it, so
+ * formatting is measured without any I/O
+ */
+class CountingBuffer : public streambuf {
+private:
+    size_t _bytes = 0;
+
+protected:
+    int overflow(int c) override {
+        ++_bytes;
+        return c;
+    }
+
+    streamsize xsputn(const char *, streamsize count) override {
+        _bytes += (size_t)count;
+        return count;
+    }
+
+public:
+    size_t bytes() const { return _bytes; }
+};
+
+/**
+ * Synthetic transactions files and timings of the Transactions commands,
+ * reported as JSON in the layout of Google Benchmark
+ */
+class Benchmark {
+private:
+    size_t _rows = 1000000;
+    size_t _symbols = 500;
+    double _invalidRate = 0.01;
+    unsigned _jobs = 1;
+    unsigned _iterations = 5;
+    uint64_t _seed = 1;
+
+    string _results;
+
+    /**
+     * splitmix64 step, the same sequence on every platform
+     */
+    static uint64_t random(uint64_t &state) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    static double seconds(chrono::steady_clock::time_point start) {
+        return chrono::duration<double>(chrono::steady_clock::now() - start)
+            .count();
+    }
+
+    /**
+     * Add a result, time per iteration in milliseconds
+     */
+    void report(const string &name, unsigned iterations, double elapsed,
+                size_t items, size_t bytes, const string &extra = "") {
+        const double perIteration = elapsed / iterations;
+        ostringstream oss;
+        oss << setprecision(6);
+        oss << (_results.empty() ? "" : ",\n") << "    {\"name\": \"" << name
+            << "\", \"iterations\": " << iterations
+            << ", \"real_time\": " << perIteration * 1e3
+            << ", \"time_unit\": \"ms\"";
+        if (items) {
+            oss << ", \"items_per_second\": " << items / perIteration;
+        }
+        if (bytes) {
+            oss << ", \"bytes_per_second\": " << bytes / perIteration;
+        }
+        oss << extra << "}";
+        _results += oss.str();
+    }
+
+    /**
+     * Time building and destroying the positions of random trades, which
+     * open and close FIFO lots
+     */
+    void benchmarkPositions() {
+        uint64_t state = _seed;
+        vector<uint64_t> trades(_rows);
+        for (uint64_t &trade : trades) {
+            trade = random(state);
+        }
+
+        double build = 0.0, teardown = 0.0;
+        for (unsigned i = 0; i < _iterations; ++i) {
+            unique_ptr<PositionBook> book(new PositionBook());
+            auto start = chrono::steady_clock::now();
+            for (uint64_t r : trades) {
+                book->update((int)(r & 1) + Stock::BUY,
+                             (uint32_t)((r >> 1) % 1000) + 1,
+                             (uint32_t)((r >> 11) % _symbols),
+                             (double)((r >> 40) % 100000 + 1) / 100);
+            }
+            build += seconds(start);
+
+            start = chrono::steady_clock::now();
+            book.reset();
+            teardown += seconds(start);
+        }
+        report("positions/build", _iterations, build, _rows, 0);
+        report("positions/teardown", _iterations, teardown, _rows, 0);
+    }
+
+    /**
+     * Time the matching engine on order events priced a few ticks around a
+     * per-symbol random walk, so that books both rest and cross orders
+     */
+    void benchmarkMatching() {
+        struct Order {
+            int type;
+            uint32_t quantity;
+            uint32_t symbolId;
+            double price;
+        };
+
+        uint64_t state = _seed;
+        vector<long long> mids(_symbols, 10000);
+        vector<Order> orders(_rows);
+        for (size_t i = 0; i < _rows; ++i) {
+            const uint64_t r = random(state);
+            const uint32_t symbol = (uint32_t)(r % _symbols);
+            long long &mid = mids[symbol];
+            mid = max(100LL, mid + (long long)((r >> 20) % 3) - 1);
+            const int type = (int)((r >> 24) & 1) + Stock::BUY;
+
+            // Buys mostly below the mid and sells above, with some crossing
+            const long long offset = (long long)((r >> 25) % 20) - 4;
+            const long long ticks =
+                Stock::BUY == type ? mid - offset : mid + offset;
+            orders[i] = {type, (uint32_t)((r >> 40) % 1000) + 1, symbol,
+                         (double)ticks / 100};
+        }
+
+        size_t fills = 0;
+        auto onFill = [&](uint64_t, uint64_t, double, uint32_t) { ++fills; };
+        double elapsed = 0.0;
+        for (unsigned i = 0; i < _iterations; ++i) {
+            MatchingEngine engine;
+            const auto start = chrono::steady_clock::now();
+            for (size_t j = 0; j < _rows; ++j) {
+                const Order &order = orders[j];
+                engine.submit(order.type, j + 1, order.quantity,
+                              order.symbolId, order.price, onFill);
+            }
+            elapsed += seconds(start);
+        }
+        report("match", _iterations, elapsed, _rows, 0,
+               ", \"fills\": " + to_string(fills / _iterations));
+
+        // Latency of each event, clock overhead included
+        MatchingEngine engine;
+        vector<double> latencies(_rows);
+        for (size_t j = 0; j < _rows; ++j) {
+            const Order &order = orders[j];
+            const auto start = chrono::steady_clock::now();
+            engine.submit(order.type, j + 1, order.quantity, order.symbolId,
+                          order.price, onFill);
+            latencies[j] = chrono::duration<double, nano>(
+                               chrono::steady_clock::now() - start)
+                               .count();
+        }
+
+        double total = 0.0;
+        for (double latency : latencies) {
+            total += latency;
+        }
+
+        ostringstream extra;
+        for (double quantile : {0.5, 0.99}) {
+            auto nth = latencies.begin() +
+                       (ptrdiff_t)(quantile * (double)(_rows - 1));
+            nth_element(latencies.begin(), nth, latencies.end());
+            extra << ", \"p" << (int)(quantile * 100) << "_ns\": " << *nth;
+        }
+        report("match/latency", 1, total / 1e9, _rows, 0, extra.str());
+    }
+
+    /**
+     * Time producer threads submitting trades through the ingestion queue,
+     * and through the mutex that serializes them when it is not running
+     */
+    void benchmarkIngest() {
+        vector<string> symbols;
+        for (size_t i = 0; i < _symbols; ++i) {
+            symbols.push_back("S" + to_string(i));
+        }
+
+        CountingBuffer sink;
+        ostream discard(&sink);
+        istringstream none;
+
+        vector<unsigned> producers = {1};
+        if (_jobs > 1) {
+            producers.push_back(_jobs);
+        }
+        for (bool queued : {true, false}) {
+            for (unsigned threads : producers) {
+                double elapsed = 0.0;
+                for (unsigned i = 0; i < _iterations; ++i) {
+                    Transactions transact(none, discard);
+                    const auto start = chrono::steady_clock::now();
+                    if (queued) {
+                        transact.startIngest();
+                    }
+
+                    vector<thread> pool;
+                    for (unsigned t = 0; t < threads; ++t) {
+                        pool.emplace_back([&, t]() {
+                            for (size_t j = t; j < _rows; j += threads) {
+                                transact.submit(
+                                    (int)(j & 1) + Stock::BUY,
+                                    (int)(j % 1000) + 1,
+                                    symbols[j % symbols.size()],
+                                    (double)(j % 100000 + 1) / 100);
+                            }
+                        });
+                    }
+                    for (thread &producer : pool) {
+                        producer.join();
+                    }
+
+                    transact.stopIngest();
+                    elapsed += seconds(start);
+                }
+                report(string(queued ? "ingest" : "ingest/mutex") +
+                           "/producers:" + to_string(threads),
+                       _iterations, elapsed, _rows, 0);
+            }
+        }
+    }
+
+public:
+    /**
+     * Parse the benchmark options
+     *
+     * @return false on an unknown option
+     */
+    bool configure(int argc, const char *argv[]) {
+        for (; argc > 1; argc -= 2, argv += 2) {
+            if (0 == strcmp(argv[0], "--rows")) {
+                _rows = (size_t)max(1LL, atoll(argv[1]));
+            } else if (0 == strcmp(argv[0], "--symbols")) {
+                _symbols = (size_t)max(1LL, atoll(argv[1]));
+            } else if (0 == strcmp(argv[0], "--invalid-rate")) {
+                _invalidRate = min(1.0, max(0.0, atof(argv[1])));
+            } else if (0 == strcmp(argv[0], "--jobs")) {
+                _jobs = (unsigned)max(1, atoi(argv[1]));
+            } else if (0 == strcmp(argv[0], "--iterations")) {
+                _iterations = (unsigned)max(1, atoi(argv[1]));
+            } else if (0 == strcmp(argv[0], "--seed")) {
+                _seed = strtoull(argv[1], nullptr, 10);
+            } else {
+                return false;
+            }
+        }
+
+        return 0 == argc;
+    }
+
+    /**
+     * Generate a transactions file. Invalid rows are spread evenly between
+     * a negative quantity, a negative price and a malformed line.
+     *
+     * @return Contents of the file
+     */
+    string generate() const {
+        uint64_t state = _seed;
+        int64_t timestamp = 1700000000000LL;
+
+        string data;
+        data.reserve(_rows * 40);
+        char line[96];
+        for (size_t i = 0; i < _rows; ++i) {
+            const uint64_t r = random(state);
+            const int type = (int)(r & 1) + Stock::BUY;
+            const unsigned symbol = (unsigned)((r >> 1) % _symbols);
+            const unsigned quantity = (unsigned)((r >> 24) % 1000) + 1;
+            const double price = (double)((r >> 34) % 100000 + 1) / 100;
+            timestamp += (int64_t)((r >> 60) & 7);
+
+            int length;
+            // Uniform in [0, 1) from the top 53 bits
+            const double draw =
+                (double)(random(state) >> 11) / 9007199254740992.0;
+            if (draw >= _invalidRate) {
+                length = snprintf(line, sizeof(line), "%d %u S%u %.2f %lld\n",
+                                  type, quantity, symbol, price,
+                                  (long long)timestamp);
+            } else if (0 == i % 3) {
+                length = snprintf(line, sizeof(line), "%d -%u S%u %.2f\n",
+                                  type, quantity, symbol, price);
+            } else if (1 == i % 3) {
+                length = snprintf(line, sizeof(line), "%d %u S%u -%.2f\n",
+                                  type, quantity, symbol, price);
+            } else {
+                length = snprintf(line, sizeof(line), "%d %u S%u\n", type,
+                                  quantity, symbol);
+            }
+            data.append(line, (size_t)length);
+        }
+
+        return data;
+    }
+
+    /**
+     * Run all benchmarks and write the JSON report
+     */
+    void run(ostream &out) {
+        const string data = generate();
+        CountingBuffer sink;
+        ostream discard(&sink);
+        istringstream none;
+
+        vector<unsigned> jobs = {1};
+        if (_jobs > 1) {
+            jobs.push_back(_jobs);
+        }
+        double teardown = 0.0;
+        for (unsigned threads : jobs) {
+            double elapsed = 0.0;
+            for (unsigned i = 0; i < _iterations; ++i) {
+                unique_ptr<Transactions> transact(
+                    new Transactions(none, discard));
+                auto start = chrono::steady_clock::now();
+                transact->load(data.data(), data.size(), threads);
+                elapsed += seconds(start);
+
+                start = chrono::steady_clock::now();
+                transact.reset();
+                teardown += seconds(start);
+            }
+            report("load/jobs:" + to_string(threads), _iterations, elapsed,
+                   _rows, data.size());
+        }
+        report("teardown", _iterations * (unsigned)jobs.size(), teardown,
+               _rows, 0);
+
+        // Commands run through the command loop as a user would issue them
+        const unsigned summaries = 100;
+        {
+            string script;
+            for (unsigned i = 0; i < summaries; ++i) {
+                script += "summary\n";
+            }
+            istringstream commands(script + "exit\n");
+            Transactions scripted(commands, discard);
+            scripted.load(data.data(), data.size(), _jobs);
+
+            const auto start = chrono::steady_clock::now();
+            scripted.run();
+            report("summary", summaries, seconds(start), _rows, 0);
+        }
+
+        {
+            string script;
+            for (unsigned i = 0; i < summaries; ++i) {
+                script += "symbols\n";
+            }
+            istringstream commands(script + "exit\n");
+            Transactions scripted(commands, discard);
+            scripted.load(data.data(), data.size(), _jobs);
+
+            const auto start = chrono::steady_clock::now();
+            scripted.run();
+            report("summary/symbols", summaries, seconds(start), _rows, 0);
+        }
+
+        {
+            string script;
+            for (unsigned i = 0; i < _iterations; ++i) {
+                script += "display\n";
+            }
+            istringstream commands(script + "exit\n");
+            Transactions scripted(commands, discard);
+            scripted.load(data.data(), data.size(), _jobs);
+
+            const size_t before = sink.bytes();
+            const auto start = chrono::steady_clock::now();
+            scripted.run();
+            const double elapsed = seconds(start);
+            report("display", _iterations, elapsed, _rows,
+                   (sink.bytes() - before) / _iterations);
+        }
+
+        {
+            const size_t count = min(_rows, (size_t)100000);
+            vector<BuyTransaction> stocks;
+            stocks.reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                stocks.emplace_back((int)(i % 1000) + 1,
+                                    "S" + to_string(i % _symbols),
+                                    (double)(i % 100000 + 1) / 100);
+            }
+
+            size_t bytes = 0;
+            const auto start = chrono::steady_clock::now();
+            for (unsigned i = 0; i < _iterations; ++i) {
+                for (const Stock &stock : stocks) {
+                    bytes += stock.toString().size();
+                }
+            }
+            report("to_string", _iterations, seconds(start), count,
+                   bytes / _iterations);
+        }
+
+        {
+            // The first session builds the indexes, the second reuses them
+            uint64_t state = _seed;
+            const unsigned queries = 1000;
+            string script = "query qty<0\nexit\n";
+            for (unsigned i = 0; i < queries; ++i) {
+                const uint64_t r = random(state);
+                script += "query symbol=S" + to_string(r % _symbols) +
+                          " price>=" + to_string((r >> 32) % 900) +
+                          " qty<" + to_string((r >> 48) % 1000 + 1) + "\n";
+            }
+            istringstream commands(script + "exit\n");
+            Transactions scripted(commands, discard);
+            scripted.load(data.data(), data.size(), _jobs);
+
+            auto start = chrono::steady_clock::now();
+            scripted.run();
+            report("query/build", 1, seconds(start), _rows, 0);
+
+            start = chrono::steady_clock::now();
+            scripted.run();
+            report("query", queries, seconds(start), queries, 0);
+        }
+
+        benchmarkPositions();
+        benchmarkMatching();
+        benchmarkIngest();
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        out << "{\n  \"context\": {\"rows\": " << _rows
+            << ", \"symbols\": " << _symbols
+            << ", \"invalid_rate\": " << _invalidRate
+            << ", \"jobs\": " << _jobs << ", \"seed\": " << _seed
+            << ", \"file_bytes\": " << data.size()
+            << ", \"simd\": \""
+            << SummaryKernel::name(SummaryKernel::detect())
+            << "\", \"peak_rss_kb\": " << usage.ru_maxrss << "},\n"
+            << "  \"benchmarks\": [\n"
+            << _results << "\n  ]\n}" << endl;
+    }
+};
+
+int main(int argc, const char *argv[]) {
+    Benchmark bench;
+    if (!bench.configure(argc - 1, argv + 1)) {
+        cerr << "usage: bench_transact_stocks [--rows N] [--symbols N] "
+                "[--invalid-rate F] [--jobs N] [--iterations N] [--seed N]"
+             << endl;
+        return 1;
+    }
+
+    bench.run(cout);
+    return 0;
+}
+
+#else
 
 int main(int argc, const char *argv[]) {
     // Skip program name
@@ -379,23 +6155,86 @@ int main(int argc, const char *argv[]) {
     ++argv;
 
     Transactions transact;
+    string journalFile;
+#if STATS_ENABLED
+    string statsFile;
+#endif
+    long latencyMicros = 500, compactMegabytes = 64;
+    bool summaryOnly = false;
 
-    // If we have to load transactions from file, load it before starting user
-    // interactions
-    if (argc) {
-        ifstream in(argv[0]);
-        if (in.is_open()) {
-            cout << "Loading transaction data from file: " << argv[0] << endl;
-            transact.load(in);
-            in.close();
+    // Options come before the optional transactions files
+    for (; argc && 0 == strncmp(argv[0], "--", 2); --argc, ++argv) {
+        if (0 == strcmp(argv[0], "--jobs") && argc > 1) {
+            --argc;
+            ++argv;
+            transact.setJobs((unsigned)max(1, atoi(argv[0])));
+        } else if (0 == strcmp(argv[0], "--journal") && argc > 1) {
+            --argc;
+            ++argv;
+            journalFile = argv[0];
+        } else if (0 == strcmp(argv[0], "--journal-latency-us") && argc > 1) {
+            --argc;
+            ++argv;
+            latencyMicros = max(0L, atol(argv[0]));
+        } else if (0 == strcmp(argv[0], "--compact-mb") && argc > 1) {
+            --argc;
+            ++argv;
+            compactMegabytes = max(1L, atol(argv[0]));
+        } else if (0 == strcmp(argv[0], "--summary-only")) {
+            summaryOnly = true;
+#if STATS_ENABLED
+        } else if (0 == strcmp(argv[0], "--stats-file") && argc > 1) {
+            --argc;
+            ++argv;
+            statsFile = argv[0];
+#endif
         } else {
-            cout << "Error loading transaction data from file: " << argv[0]
+            cout << "Ignoring unknown option: " << argv[0] << endl;
+        }
+    }
+
+    // Summarize the files, or stdin if there are none, without interaction
+    if (summaryOnly) {
+        vector<string> fileNames(argv, argv + argc);
+        if (fileNames.empty()) {
+            fileNames.push_back("-");
+        }
+        bool ok = transact.summarize(fileNames);
+#if STATS_ENABLED
+        if (!statsFile.empty() && !transact.writeStats(statsFile)) {
+            cerr << "Failed to write statistics to file: " << statsFile
                  << endl;
+            ok = false;
         }
+#endif
+        return ok ? 0 : 1;
+    }
+
+    // If we have to load transactions from files, load them in order before
+    // starting user interactions
+    for (; argc; --argc, ++argv) {
+        transact.loadFile(argv[0]);
+    }
+
+    // Transactions journaled by earlier sessions come after the files
+    if (!journalFile.empty() &&
+        !transact.openJournal(journalFile,
+                              chrono::microseconds(latencyMicros),
+                              (uint64_t)compactMegabytes << 20)) {
+        return 1;
     }
 
     // Start user interaction command loop
     transact.run();
 
+#if STATS_ENABLED
+    if (!statsFile.empty() && !transact.writeStats(statsFile)) {
+        cerr << "Failed to write statistics to file: " << statsFile << endl;
+        return 1;
+    }
+#endif
+
     return 0;
-}
\ No newline at end of file
+}
+
+#endif